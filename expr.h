@@ -8,22 +8,35 @@ extern "C" {
 #include <ctype.h> /* for isspace */
 #include <limits.h>
 #include <math.h> /* for pow */
+#include <stddef.h> /* for offsetof */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+/*
+ * All functions are static. Optional entry points are marked, so programs
+ * that don't call them still build without unused function warnings.
+ */
+#if defined(__GNUC__)
+#define EXPR_UNUSED __attribute__((unused))
+#else
+#define EXPR_UNUSED
+#endif
+
 /*
  * Simple expandable vector implementation
  */
-static int vec_expand(char **buf, int *length, int *cap, int memsz) {
+/* Buffer pointer may be of any type, so it's only accessed with memcpy */
+static int vec_expand(void *buf, int *length, int *cap, int memsz) {
   if (*length + 1 > *cap) {
     void *ptr;
     int n = (*cap == 0) ? 1 : *cap << 1;
-    ptr = realloc(*buf, n * memsz);
+    memcpy(&ptr, buf, sizeof(ptr));
+    ptr = realloc(ptr, n * memsz);
     if (ptr == NULL) {
       return -1; /* allocation failed */
     }
-    *buf = (char *)ptr;
+    memcpy(buf, &ptr, sizeof(ptr));
     *cap = n;
   }
   return 0;
@@ -38,9 +51,9 @@ static int vec_expand(char **buf, int *length, int *cap, int memsz) {
   { NULL, 0, 0 }
 #define vec_len(v) ((v)->len)
 #define vec_unpack(v)                                                          \
-  (char **)&(v)->buf, &(v)->len, &(v)->cap, sizeof(*(v)->buf)
+  (void *)&(v)->buf, &(v)->len, &(v)->cap, sizeof(*(v)->buf)
 #define vec_push(v, val)                                                       \
-  vec_expand(vec_unpack(v)) ? -1 : ((v)->buf[(v)->len++] = (val), 0)
+  (vec_expand(vec_unpack(v)) ? -1 : ((v)->buf[(v)->len++] = (val), 0))
 #define vec_nth(v, i) (v)->buf[i]
 #define vec_peek(v) (v)->buf[(v)->len - 1]
 #define vec_pop(v) (v)->buf[--(v)->len]
@@ -98,18 +111,121 @@ enum expr_type {
 static int prec[] = {0, 1, 1, 1, 2, 2, 2, 2, 3,  3,  4,  4, 5, 5,
                      5, 5, 5, 5, 6, 7, 8, 9, 10, 11, 12, 0, 0, 0};
 
+/*
+ * Numbers are floats by default. Build with EXPR_DOUBLE=1 for double precision
+ * or EXPR_INT64=1 for 64-bit integers. Integers wrap around on overflow, there
+ * is no NaN, division and remainder by zero give zero, shift counts are taken
+ * modulo 64 and bitwise operators work on numbers without conversion.
+ */
+#ifndef EXPR_DOUBLE
+#define EXPR_DOUBLE 0
+#endif
+#ifndef EXPR_INT64
+#define EXPR_INT64 0
+#endif
+
+#if EXPR_INT64
+typedef long long expr_num_t;
+typedef long long expr_int_t;
+#define EXPR_NAN 0
+#define expr_isnan(x) 0
+#define to_int(x) (x)
+#elif EXPR_DOUBLE
+typedef double expr_num_t;
+typedef int expr_int_t;
+#define EXPR_NAN ((double)NAN)
+#define expr_isnan(x) isnan(x)
+#define expr_pow(a, b) pow(a, b)
+#define expr_fmod(a, b) fmod(a, b)
+#else
+typedef float expr_num_t;
+typedef int expr_int_t;
+#define EXPR_NAN NAN
+#define expr_isnan(x) isnan(x)
+#define expr_pow(a, b) powf(a, b)
+#define expr_fmod(a, b) fmodf(a, b)
+#endif
+
+#if EXPR_INT64
+#define expr_neg(a) ((expr_num_t)(0ULL - (unsigned long long)(a)))
+#define expr_add(a, b)                                                         \
+  ((expr_num_t)((unsigned long long)(a) + (unsigned long long)(b)))
+#define expr_sub(a, b)                                                         \
+  ((expr_num_t)((unsigned long long)(a) - (unsigned long long)(b)))
+#define expr_mul(a, b)                                                         \
+  ((expr_num_t)((unsigned long long)(a) * (unsigned long long)(b)))
+#define expr_shl(a, b)                                                         \
+  ((expr_num_t)((unsigned long long)(a) << ((b)&63)))
+#define expr_shr(a, b) ((a) >> ((b)&63))
+
+static expr_num_t expr_div(expr_num_t a, expr_num_t b) {
+  return (b == 0 ? 0 : b == -1 ? expr_neg(a) : a / b);
+}
+
+static expr_num_t expr_fmod(expr_num_t a, expr_num_t b) {
+  return (b == 0 || b == -1 ? 0 : a % b);
+}
+
+static expr_num_t expr_pow(expr_num_t a, expr_num_t b) {
+  expr_num_t r = 1;
+  if (b < 0) {
+    /* Truncated reciprocal */
+    return (a == 1 ? 1 : a == -1 ? ((b & 1) ? -1 : 1) : 0);
+  }
+  for (; b > 0; b >>= 1) {
+    if (b & 1) {
+      r = expr_mul(r, a);
+    }
+    a = expr_mul(a, a);
+  }
+  return r;
+}
+#else
+#define expr_neg(a) (-(a))
+#define expr_add(a, b) ((a) + (b))
+#define expr_sub(a, b) ((a) - (b))
+#define expr_mul(a, b) ((a) * (b))
+#define expr_div(a, b) ((a) / (b))
+/* Shift counts are taken modulo 32, like x86 shifts do */
+#define expr_shl(a, b) ((expr_int_t)((unsigned int)(a) << ((b)&31)))
+#define expr_shr(a, b) ((a) >> ((b)&31))
+
+/* Finite numbers out of the int range give INT_MIN, like cvttss2si does */
+static expr_int_t to_int(expr_num_t x) {
+  if (expr_isnan(x)) {
+    return 0;
+  } else if (isinf(x) != 0) {
+    return INT_MAX * isinf(x);
+  } else if (x <= -2147483649.0 || x >= 2147483648.0) {
+    return INT_MIN;
+  } else {
+    return (int)x;
+  }
+}
+#endif
+
 typedef vec(struct expr) vec_expr_t;
 typedef void (*exprfn_cleanup_t)(struct expr_func *f, void *context);
-typedef float (*exprfn_t)(struct expr_func *f, vec_expr_t *args, void *context);
+typedef expr_num_t (*exprfn_t)(struct expr_func *f, vec_expr_t *args,
+                               void *context);
+#if JIT
+typedef expr_num_t (*expr_jit_fn_t)(void);
+typedef void (*expr_jit_batch_fn_t)(expr_num_t *values, expr_num_t *out, int n);
+
+/* Native code compiler, see expr_jit.dasc */
+static expr_jit_fn_t expr_compile(struct expr *e, size_t *sz);
+static expr_jit_batch_fn_t expr_compile_batch(struct expr *e, size_t *sz);
+static void expr_jit_release(struct expr *e);
+#endif
 
 struct expr {
   enum expr_type type;
   union {
     struct {
-      float value;
+      expr_num_t value;
     } num;
     struct {
-      float *value;
+      expr_num_t *value;
     } var;
     struct {
       vec_expr_t args;
@@ -120,6 +236,12 @@ struct expr {
       void *context;
     } func;
   } param;
+#if JIT
+  expr_jit_fn_t fn; /* native code compiled for the root expression */
+  size_t jitsz;
+  expr_jit_batch_fn_t batchfn; /* SIMD kernel for expr_eval_batch() */
+  size_t batchsz;
+#endif
 };
 
 #define expr_init()                                                            \
@@ -128,11 +250,13 @@ struct expr {
 struct expr_string {
   const char *s;
   int n;
+  enum expr_type op; /* OP_UNKNOWN for parens and function names */
 };
 struct expr_arg {
   int oslen;
   int eslen;
   vec_expr_t args;
+  struct expr_func *f; /* function bound at the opening paren */
 };
 
 typedef vec(struct expr_string) vec_str_t;
@@ -148,6 +272,12 @@ static int expr_is_binary(enum expr_type op) {
          op != OP_FUNC && op != OP_UNKNOWN;
 }
 
+/* Bitwise operators and shifts take integers and give an integer */
+static int expr_is_int(enum expr_type op) {
+  return op == OP_UNARY_BITWISE_NOT || op == OP_SHL || op == OP_SHR ||
+         op == OP_BITWISE_AND || op == OP_BITWISE_OR || op == OP_BITWISE_XOR;
+}
+
 static int expr_prec(enum expr_type a, enum expr_type b) {
   int left =
       expr_is_binary(a) && a != OP_ASSIGN && a != OP_POWER && a != OP_COMMA;
@@ -160,54 +290,103 @@ static int expr_prec(enum expr_type a, enum expr_type b) {
   (((unsigned char)c >= '@' && c != '^' && c != '|') || c == '$' ||            \
    c == '#' || (c >= '0' && c <= '9'))
 
-static struct {
-  const char *s;
-  const enum expr_type op;
-} OPS[] = {
-    {"-u", OP_UNARY_MINUS},
-    {"!u", OP_UNARY_LOGICAL_NOT},
-    {"^u", OP_UNARY_BITWISE_NOT},
-    {"**", OP_POWER},
-    {"*", OP_MULTIPLY},
-    {"/", OP_DIVIDE},
-    {"%", OP_REMAINDER},
-    {"+", OP_PLUS},
-    {"-", OP_MINUS},
-    {"<<", OP_SHL},
-    {">>", OP_SHR},
-    {"<", OP_LT},
-    {"<=", OP_LE},
-    {">", OP_GT},
-    {">=", OP_GE},
-    {"==", OP_EQ},
-    {"!=", OP_NE},
-    {"&", OP_BITWISE_AND},
-    {"|", OP_BITWISE_OR},
-    {"^", OP_BITWISE_XOR},
-    {"&&", OP_LOGICAL_AND},
-    {"||", OP_LOGICAL_OR},
-    {"=", OP_ASSIGN},
-    {",", OP_COMMA},
-
-    /* These are used by lexer and must be ignored by parser, so we put
-       them at the end */
-    {"-", OP_UNARY_MINUS},
-    {"!", OP_UNARY_LOGICAL_NOT},
-    {"^", OP_UNARY_BITWISE_NOT},
-};
+#define EXPR_OP2(a, b) (((unsigned char)(a) << 8) | (unsigned char)(b))
 
+/* Operator of the given text, unary is 0 or 1 to accept only binary or unary
+   operators, or -1 to accept both. "-u", "!u" and "^u" are unary operators. */
 static enum expr_type expr_op(const char *s, size_t len, int unary) {
-  for (unsigned int i = 0; i < sizeof(OPS) / sizeof(OPS[0]); i++) {
-    if (strlen(OPS[i].s) == len && strncmp(OPS[i].s, s, len) == 0 &&
-        (unary == -1 || expr_is_unary(OPS[i].op) == unary)) {
-      return OPS[i].op;
+  enum expr_type op = OP_UNKNOWN;
+  if (len == 1) {
+    switch (s[0]) {
+    case '*':
+      op = OP_MULTIPLY;
+      break;
+    case '/':
+      op = OP_DIVIDE;
+      break;
+    case '%':
+      op = OP_REMAINDER;
+      break;
+    case '+':
+      op = OP_PLUS;
+      break;
+    case '-':
+      op = (unary == 1 ? OP_UNARY_MINUS : OP_MINUS);
+      break;
+    case '<':
+      op = OP_LT;
+      break;
+    case '>':
+      op = OP_GT;
+      break;
+    case '&':
+      op = OP_BITWISE_AND;
+      break;
+    case '|':
+      op = OP_BITWISE_OR;
+      break;
+    case '^':
+      op = (unary == 1 ? OP_UNARY_BITWISE_NOT : OP_BITWISE_XOR);
+      break;
+    case '!':
+      op = OP_UNARY_LOGICAL_NOT;
+      break;
+    case '=':
+      op = OP_ASSIGN;
+      break;
+    case ',':
+      op = OP_COMMA;
+      break;
+    }
+  } else if (len == 2) {
+    switch (EXPR_OP2(s[0], s[1])) {
+    case EXPR_OP2('-', 'u'):
+      op = OP_UNARY_MINUS;
+      break;
+    case EXPR_OP2('!', 'u'):
+      op = OP_UNARY_LOGICAL_NOT;
+      break;
+    case EXPR_OP2('^', 'u'):
+      op = OP_UNARY_BITWISE_NOT;
+      break;
+    case EXPR_OP2('*', '*'):
+      op = OP_POWER;
+      break;
+    case EXPR_OP2('<', '<'):
+      op = OP_SHL;
+      break;
+    case EXPR_OP2('>', '>'):
+      op = OP_SHR;
+      break;
+    case EXPR_OP2('<', '='):
+      op = OP_LE;
+      break;
+    case EXPR_OP2('>', '='):
+      op = OP_GE;
+      break;
+    case EXPR_OP2('=', '='):
+      op = OP_EQ;
+      break;
+    case EXPR_OP2('!', '='):
+      op = OP_NE;
+      break;
+    case EXPR_OP2('&', '&'):
+      op = OP_LOGICAL_AND;
+      break;
+    case EXPR_OP2('|', '|'):
+      op = OP_LOGICAL_OR;
+      break;
     }
   }
-  return OP_UNKNOWN;
+  if (unary != -1 && op != OP_UNKNOWN && expr_is_unary(op) != unary) {
+    return OP_UNKNOWN;
+  }
+  return op;
 }
 
-static float expr_parse_number(const char *s, size_t len) {
-  float num = 0;
+/* Returns -1 if it's not a number, fraction digits of integers are ignored */
+static int expr_parse_number(const char *s, size_t len, expr_num_t *result) {
+  expr_num_t num = 0;
   unsigned int frac = 0;
   unsigned int digits = 0;
   for (unsigned int i = 0; i < len; i++) {
@@ -219,17 +398,30 @@ static float expr_parse_number(const char *s, size_t len) {
       digits++;
       if (frac > 0) {
         frac++;
+        if (EXPR_INT64) {
+          continue;
+        }
       }
-      num = num * 10 + (s[i] - '0');
+      /* Integers wrap like arithmetic does, without signed overflow */
+      num = expr_add(expr_mul(num, 10), s[i] - '0');
     } else {
-      return NAN;
+      return -1;
     }
   }
-  while (frac > 1) {
+  while (frac > 1 && !EXPR_INT64) {
     num = num / 10;
     frac--;
   }
-  return (digits > 0 ? num : NAN);
+  *result = num;
+  return (digits > 0 ? 0 : -1);
+}
+
+static unsigned int expr_hash(const char *s, size_t len) {
+  unsigned int h = 2166136261u; /* FNV-1a */
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)s[i]) * 16777619u;
+  }
+  return h;
 }
 
 /*
@@ -240,40 +432,166 @@ struct expr_func {
   exprfn_t f;
   exprfn_cleanup_t cleanup;
   size_t ctxsz;
+  int pure; /* result depends only on the arguments, no side effects */
+  int threadsafe; /* may be called by many threads at once */
 };
 
 static struct expr_func *expr_func(struct expr_func *funcs, const char *s,
                                    size_t len) {
   for (struct expr_func *f = funcs; f->name; f++) {
-    if (strlen(f->name) == len && strncmp(f->name, s, len) == 0) {
+    if (strncmp(f->name, s, len) == 0 && f->name[len] == '\0') {
       return f;
     }
   }
   return NULL;
 }
 
+/*
+ * Registry is a hash table over a NULL-terminated array of functions, built
+ * once and shared by any number of expr_create_ex() calls. Registry without
+ * the table searches the array linearly, like expr_func().
+ */
+struct expr_func_registry {
+  struct expr_func *funcs;
+  struct expr_func **index;
+  int size; /* table size, power of two */
+};
+
+EXPR_UNUSED
+static int expr_func_registry_init(struct expr_func_registry *r,
+                                   struct expr_func *funcs) {
+  unsigned int i, mask;
+  int n = 0;
+  r->funcs = funcs;
+  r->size = 16;
+  for (struct expr_func *f = funcs; f != NULL && f->name; f++) {
+    n++;
+  }
+  while (r->size < n * 2) {
+    r->size = r->size * 2;
+  }
+  r->index = (struct expr_func **)calloc(r->size, sizeof(struct expr_func *));
+  if (r->index == NULL) {
+    return -1; /* allocation failed */
+  }
+  mask = r->size - 1;
+  for (struct expr_func *f = funcs; f != NULL && f->name; f++) {
+    /* The first of functions with the same name wins, as in expr_func() */
+    i = expr_hash(f->name, strlen(f->name)) & mask;
+    while (r->index[i] != NULL && strcmp(r->index[i]->name, f->name) != 0) {
+      i = (i + 1) & mask;
+    }
+    if (r->index[i] == NULL) {
+      r->index[i] = f;
+    }
+  }
+  return 0;
+}
+
+static struct expr_func *expr_func_lookup(struct expr_func_registry *r,
+                                          const char *s, size_t len) {
+  if (r->index == NULL) {
+    return (r->funcs != NULL ? expr_func(r->funcs, s, len) : NULL);
+  }
+  unsigned int mask = r->size - 1;
+  for (unsigned int i = expr_hash(s, len) & mask; r->index[i];
+       i = (i + 1) & mask) {
+    if (strncmp(r->index[i]->name, s, len) == 0 &&
+        r->index[i]->name[len] == '\0') {
+      return r->index[i];
+    }
+  }
+  return NULL;
+}
+
+EXPR_UNUSED
+static void expr_func_registry_free(struct expr_func_registry *r) {
+  free(r->index);
+  r->index = NULL;
+}
+
 /*
  * Variables
  */
 struct expr_var {
-  float value;
+  expr_num_t value;
   struct expr_var *next;
   char name[];
 };
 
+/*
+ * Short lists are searched linearly. Once a list grows to EXPR_VAR_INDEX_MIN
+ * variables an open addressing hash table is built over it. The table is
+ * rebuilt if variables are added to the list directly, bypassing expr_var().
+ */
+#ifndef EXPR_VAR_INDEX_MIN
+#define EXPR_VAR_INDEX_MIN 16
+#endif
+
 struct expr_var_list {
   struct expr_var *head;
+  struct expr_var **index; /* hash table, NULL for short lists */
+  int count;               /* variables in the table */
+  int size;                /* table size, power of two */
+  struct expr_var *tail;   /* head of the list when the table was updated */
+  struct expr_var *temps;  /* hidden variables, see expr_var_temp() */
+  int ntemps;
 };
 
+static int expr_var_match(struct expr_var *v, const char *s, size_t len) {
+  return strncmp(v->name, s, len) == 0 && v->name[len] == '\0';
+}
+
+static void expr_var_index_insert(struct expr_var_list *vars,
+                                  struct expr_var *v) {
+  unsigned int mask = vars->size - 1;
+  unsigned int i = expr_hash(v->name, strlen(v->name)) & mask;
+  while (vars->index[i] != NULL) {
+    i = (i + 1) & mask;
+  }
+  vars->index[i] = v;
+  vars->count++;
+}
+
+/* Builds the table from the list, on failure the list is searched linearly */
+static void expr_var_index(struct expr_var_list *vars, int n) {
+  int size = 32;
+  while (size < n * 2) {
+    size = size * 2;
+  }
+  free(vars->index);
+  vars->count = 0;
+  vars->size = size;
+  vars->tail = vars->head;
+  vars->index = (struct expr_var **)calloc(size, sizeof(struct expr_var *));
+  if (vars->index != NULL) {
+    for (struct expr_var *v = vars->head; v; v = v->next) {
+      expr_var_index_insert(vars, v);
+    }
+  }
+}
+
 static struct expr_var *expr_var(struct expr_var_list *vars, const char *s,
                                  size_t len) {
   struct expr_var *v = NULL;
+  int n = 0;
   if (len == 0 || !isfirstvarchr(*s)) {
     return NULL;
   }
-  for (v = vars->head; v; v = v->next) {
-    if (strlen(v->name) == len && strncmp(v->name, s, len) == 0) {
-      return v;
+  if (vars->index != NULL && vars->tail == vars->head) {
+    unsigned int mask = vars->size - 1;
+    for (unsigned int i = expr_hash(s, len) & mask; vars->index[i];
+         i = (i + 1) & mask) {
+      if (expr_var_match(vars->index[i], s, len)) {
+        return vars->index[i];
+      }
+    }
+    n = vars->count;
+  } else {
+    for (v = vars->head; v; v = v->next, n++) {
+      if (expr_var_match(v, s, len)) {
+        return v;
+      }
     }
   }
   v = (struct expr_var *)calloc(1, sizeof(struct expr_var) + len + 1);
@@ -285,52 +603,102 @@ static struct expr_var *expr_var(struct expr_var_list *vars, const char *s,
   strncpy(v->name, s, len);
   v->name[len] = '\0';
   vars->head = v;
+  if (vars->index != NULL && vars->tail == v->next &&
+      (n + 1) * 2 <= vars->size) {
+    expr_var_index_insert(vars, v);
+    vars->tail = v;
+  } else if (n + 1 >= EXPR_VAR_INDEX_MIN) {
+    expr_var_index(vars, n + 1);
+  }
   return v;
 }
 
-static int to_int(float x) {
-  if (isnan(x)) {
-    return 0;
-  } else if (isinf(x) != 0) {
-    return INT_MAX * isinf(x);
-  } else {
-    return (int)x;
+/*
+ * Returns a new hidden variable "$@n", a temporary of a rewritten expression.
+ * Hidden variables are not on the list, so expr_var() never finds them and
+ * each one belongs to a single expression, but they are freed with the list.
+ */
+static struct expr_var *expr_var_temp(struct expr_var_list *vars) {
+  char name[16];
+  int len = snprintf(name, sizeof(name), "$@%d", vars->ntemps);
+  struct expr_var *v =
+      (struct expr_var *)calloc(1, sizeof(struct expr_var) + len + 1);
+  if (v == NULL) {
+    return NULL; /* allocation failed */
+  }
+  memcpy(v->name, name, len + 1);
+  v->next = vars->temps;
+  vars->temps = v;
+  vars->ntemps++;
+  return v;
+}
+
+/* Returns variable by the address of its value, e.g. from an OP_VAR node */
+static struct expr_var *expr_var_of(expr_num_t *value) {
+  return (struct expr_var *)((char *)value - offsetof(struct expr_var, value));
+}
+
+static expr_num_t expr_eval(struct expr *e);
+
+/*
+ * Bitwise operators and shifts form integer subtrees, which are evaluated
+ * without converting the result of every node to a number and back. Only the
+ * other nodes below them are converted with to_int().
+ */
+static expr_int_t expr_eval_int(struct expr *e) {
+  switch (e->type) {
+  case OP_UNARY_BITWISE_NOT:
+    return ~expr_eval_int(&e->param.op.args.buf[0]);
+  case OP_SHL:
+    return expr_shl(expr_eval_int(&e->param.op.args.buf[0]),
+                    expr_eval_int(&e->param.op.args.buf[1]));
+  case OP_SHR:
+    return expr_shr(expr_eval_int(&e->param.op.args.buf[0]),
+                    expr_eval_int(&e->param.op.args.buf[1]));
+  case OP_BITWISE_AND:
+    return expr_eval_int(&e->param.op.args.buf[0]) &
+           expr_eval_int(&e->param.op.args.buf[1]);
+  case OP_BITWISE_OR:
+    return expr_eval_int(&e->param.op.args.buf[0]) |
+           expr_eval_int(&e->param.op.args.buf[1]);
+  case OP_BITWISE_XOR:
+    return expr_eval_int(&e->param.op.args.buf[0]) ^
+           expr_eval_int(&e->param.op.args.buf[1]);
+  default:
+    return to_int(expr_eval(e));
   }
 }
 
-static float expr_eval(struct expr *e) {
-  float n;
+static expr_num_t expr_eval(struct expr *e) {
+  expr_num_t n;
+#if JIT
+  if (e->fn != NULL) {
+    return e->fn();
+  }
+#endif
   switch (e->type) {
   case OP_UNARY_MINUS:
-    return -(expr_eval(&e->param.op.args.buf[0]));
+    return expr_neg(expr_eval(&e->param.op.args.buf[0]));
   case OP_UNARY_LOGICAL_NOT:
     return !(expr_eval(&e->param.op.args.buf[0]));
-  case OP_UNARY_BITWISE_NOT:
-    return ~(to_int(expr_eval(&e->param.op.args.buf[0])));
   case OP_POWER:
-    return powf(expr_eval(&e->param.op.args.buf[0]),
+    return expr_pow(expr_eval(&e->param.op.args.buf[0]),
                 expr_eval(&e->param.op.args.buf[1]));
   case OP_MULTIPLY:
-    return expr_eval(&e->param.op.args.buf[0]) *
-           expr_eval(&e->param.op.args.buf[1]);
+    return expr_mul(expr_eval(&e->param.op.args.buf[0]),
+                    expr_eval(&e->param.op.args.buf[1]));
   case OP_DIVIDE:
-    return expr_eval(&e->param.op.args.buf[0]) /
-           expr_eval(&e->param.op.args.buf[1]);
+    return expr_div(expr_eval(&e->param.op.args.buf[0]),
+                    expr_eval(&e->param.op.args.buf[1]));
   case OP_REMAINDER:
-    return fmodf(expr_eval(&e->param.op.args.buf[0]),
+    return expr_fmod(expr_eval(&e->param.op.args.buf[0]),
                  expr_eval(&e->param.op.args.buf[1]));
   case OP_PLUS:
-    return expr_eval(&e->param.op.args.buf[0]) +
-           expr_eval(&e->param.op.args.buf[1]);
+    return expr_add(expr_eval(&e->param.op.args.buf[0]),
+                    expr_eval(&e->param.op.args.buf[1]));
   case OP_MINUS:
-    return expr_eval(&e->param.op.args.buf[0]) -
-           expr_eval(&e->param.op.args.buf[1]);
-  case OP_SHL:
-    return to_int(expr_eval(&e->param.op.args.buf[0]))
-           << to_int(expr_eval(&e->param.op.args.buf[1]));
-  case OP_SHR:
-    return to_int(expr_eval(&e->param.op.args.buf[0])) >>
-           to_int(expr_eval(&e->param.op.args.buf[1]));
+    return expr_sub(expr_eval(&e->param.op.args.buf[0]),
+                    expr_eval(&e->param.op.args.buf[1]));
   case OP_LT:
     return expr_eval(&e->param.op.args.buf[0]) <
            expr_eval(&e->param.op.args.buf[1]);
@@ -349,15 +717,13 @@ static float expr_eval(struct expr *e) {
   case OP_NE:
     return expr_eval(&e->param.op.args.buf[0]) !=
            expr_eval(&e->param.op.args.buf[1]);
+  case OP_UNARY_BITWISE_NOT:
+  case OP_SHL:
+  case OP_SHR:
   case OP_BITWISE_AND:
-    return to_int(expr_eval(&e->param.op.args.buf[0])) &
-           to_int(expr_eval(&e->param.op.args.buf[1]));
   case OP_BITWISE_OR:
-    return to_int(expr_eval(&e->param.op.args.buf[0])) |
-           to_int(expr_eval(&e->param.op.args.buf[1]));
   case OP_BITWISE_XOR:
-    return to_int(expr_eval(&e->param.op.args.buf[0])) ^
-           to_int(expr_eval(&e->param.op.args.buf[1]));
+    return expr_eval_int(e);
   case OP_LOGICAL_AND:
     n = expr_eval(&e->param.op.args.buf[0]);
     if (n != 0) {
@@ -369,7 +735,7 @@ static float expr_eval(struct expr *e) {
     return 0;
   case OP_LOGICAL_OR:
     n = expr_eval(&e->param.op.args.buf[0]);
-    if (n != 0 && !isnan(n)) {
+    if (n != 0 && !expr_isnan(n)) {
       return n;
     } else {
       n = expr_eval(&e->param.op.args.buf[1]);
@@ -395,7 +761,7 @@ static float expr_eval(struct expr *e) {
     return e->param.func.f->f(e->param.func.f, &e->param.func.args,
                               e->param.func.context);
   default:
-    return NAN;
+    return EXPR_NAN;
   }
 }
 
@@ -472,17 +838,12 @@ static int expr_next_token(const char *s, size_t len, int *flags) {
       *flags = EXPR_TNUMBER | EXPR_TWORD | EXPR_TOPEN | EXPR_UNARY;
       return 1;
     } else {
-      int found = 0;
-      while (!isvarchr(c) && !isspace(c) && c != '(' && c != ')' && i < len) {
-        if (expr_op(s, i + 1, 0) != OP_UNKNOWN) {
-          found = 1;
-        } else if (found) {
-          break;
-        }
-        i++;
-        c = s[i];
-      }
-      if (!found) {
+      /* Longest match, operators are at most two characters long */
+      if (len > 1 && expr_op(s, 2, 0) != OP_UNKNOWN) {
+        i = 2;
+      } else if (expr_op(s, 1, 0) != OP_UNKNOWN) {
+        i = 1;
+      } else {
         return -5; // unknown operator
       }
       *flags = EXPR_TNUMBER | EXPR_TWORD | EXPR_TOPEN;
@@ -491,44 +852,211 @@ static int expr_next_token(const char *s, size_t len, int *flags) {
   }
 }
 
+/*
+ * Arena: expressions created with expr_create_arena() take their nodes,
+ * argument arrays and function contexts from a few large blocks, which are
+ * released all at once by expr_arena_free(). Argument arrays owned by the
+ * arena have zero capacity, so they are never freed or grown one by one.
+ */
+#ifndef EXPR_ARENA_BLOCK
+#define EXPR_ARENA_BLOCK 4096
+#endif
+#define EXPR_ARENA_ALIGN(n) (((n) + 15) & ~(size_t)15)
+
+struct expr_arena_block {
+  struct expr_arena_block *next;
+  size_t size;
+  size_t used;
+};
+
+struct expr_arena_cleanup {
+  struct expr_func *f;
+  void *context;
+  struct expr_arena_cleanup *next;
+};
+
+struct expr_arena {
+  struct expr_arena_block *head;
+  struct expr_arena_cleanup *cleanups;
+#if JIT
+  vec(struct expr *) roots; /* native code is released with the arena */
+#endif
+};
+
+#define expr_arena_owned(v) ((v)->buf != NULL && (v)->cap == 0)
+#define expr_free_args(v)                                                      \
+  do {                                                                         \
+    if (!expr_arena_owned(v)) {                                                \
+      vec_free(v);                                                             \
+    }                                                                          \
+  } while (0)
+
+/* Returns n zeroed bytes aligned to 16 bytes */
+static void *expr_arena_alloc(struct expr_arena *a, size_t n) {
+  struct expr_arena_block *b = a->head;
+  size_t hdr = EXPR_ARENA_ALIGN(sizeof(struct expr_arena_block));
+  n = EXPR_ARENA_ALIGN(n);
+  if (b == NULL || b->used + n > b->size) {
+    size_t size = (b == NULL ? EXPR_ARENA_BLOCK : b->size * 2);
+    while (size < n) {
+      size = size * 2;
+    }
+    b = (struct expr_arena_block *)calloc(1, hdr + size);
+    if (b == NULL) {
+      return NULL; /* allocation failed */
+    }
+    b->next = a->head;
+    b->size = size;
+    a->head = b;
+  }
+  b->used = b->used + n;
+  return (char *)b + hdr + b->used - n;
+}
+
+/* Gives the node n arguments, taken from the arena unless it's NULL */
+static int expr_alloc_args(struct expr_arena *a, vec_expr_t *args, int n) {
+  if (a != NULL) {
+    args->buf = (struct expr *)expr_arena_alloc(
+        a, (n > 0 ? n : 1) * sizeof(struct expr));
+    args->cap = 0;
+  } else {
+    args->buf =
+        (n > 0 ? (struct expr *)calloc(n, sizeof(struct expr)) : NULL);
+    args->cap = n;
+  }
+  if (args->buf == NULL && (a != NULL || n > 0)) {
+    args->cap = 0;
+    return -1; /* allocation failed */
+  }
+  args->len = n;
+  return 0;
+}
+
+static void *expr_alloc_context(struct expr_arena *a, struct expr_func *f) {
+  struct expr_arena_cleanup *c;
+  void *p;
+  if (a == NULL) {
+    return calloc(1, f->ctxsz);
+  }
+  p = expr_arena_alloc(a, f->ctxsz);
+  if (p != NULL && f->cleanup != NULL) {
+    c = (struct expr_arena_cleanup *)expr_arena_alloc(a, sizeof(*c));
+    if (c == NULL) {
+      return NULL;
+    }
+    c->f = f;
+    c->context = p;
+    c->next = a->cleanups;
+    a->cleanups = c;
+  }
+  return p;
+}
+
 #define EXPR_PAREN_ALLOWED 0
 #define EXPR_PAREN_EXPECTED 1
 #define EXPR_PAREN_FORBIDDEN 2
 
-static int expr_bind(const char *s, size_t len, vec_expr_t *es) {
-  enum expr_type op = expr_op(s, len, -1);
+static int expr_bind(enum expr_type op, vec_expr_t *es,
+                     struct expr_arena *arena) {
   if (op == OP_UNKNOWN) {
     return -1;
   }
 
+  /* Operands are replaced with the new node in place on the stack */
   if (expr_is_unary(op)) {
+    struct expr unary = expr_init();
     if (vec_len(es) < 1) {
       return -1;
     }
-    struct expr arg = vec_pop(es);
-    struct expr unary = expr_init();
     unary.type = op;
-    vec_push(&unary.param.op.args, arg);
-    vec_push(es, unary);
+    if (expr_alloc_args(arena, &unary.param.op.args, 1) == -1) {
+      return -1;
+    }
+    vec_nth(&unary.param.op.args, 0) = vec_peek(es);
+    vec_peek(es) = unary;
   } else {
+    struct expr binary = expr_init();
     if (vec_len(es) < 2) {
       return -1;
     }
-    struct expr b = vec_pop(es);
-    struct expr a = vec_pop(es);
-    struct expr binary = expr_init();
     binary.type = op;
-    if (op == OP_ASSIGN && a.type != OP_VAR) {
+    if (op == OP_ASSIGN && vec_nth(es, vec_len(es) - 2).type != OP_VAR) {
       return -1; /* Bad assignment */
     }
-    vec_push(&binary.param.op.args, a);
-    vec_push(&binary.param.op.args, b);
-    vec_push(es, binary);
+    if (expr_alloc_args(arena, &binary.param.op.args, 2) == -1) {
+      return -1;
+    }
+    vec_nth(&binary.param.op.args, 0) = vec_nth(es, vec_len(es) - 2);
+    vec_nth(&binary.param.op.args, 1) = vec_peek(es);
+    es->len--;
+    vec_peek(es) = binary;
+  }
+  return 0;
+}
+
+#define EXPR_BALANCE_MIN 64
+
+/*
+ * Joins statements into a balanced comma tree, pairs level by level, taking
+ * operands of the comma nodes from links (one less than the statements).
+ */
+static struct expr expr_join(vec_expr_t *items, vec_expr_t *links) {
+  int i, k, next = 0;
+  while (vec_len(items) > 1) {
+    for (i = 0, k = 0; i < vec_len(items); i += 2, k++) {
+      struct expr comma = expr_init();
+      if (i + 1 == vec_len(items)) {
+        vec_nth(items, k) = vec_nth(items, i);
+        continue;
+      }
+      comma.type = OP_COMMA;
+      comma.param.op.args = links[next++];
+      vec_nth(&comma.param.op.args, 0) = vec_nth(items, i);
+      vec_nth(&comma.param.op.args, 1) = vec_nth(items, i + 1);
+      vec_nth(items, k) = comma;
+    }
+    items->len = k;
+  }
+  return vec_nth(items, 0);
+}
+
+/*
+ * Statements of a script are joined with commas into a chain as deep as the
+ * script is long. Rebuilds a long chain into a balanced tree with statements
+ * in the same order, so evaluation and other passes recurse only log(n) deep.
+ * Returns -1 if memory can not be allocated, the chain is kept as it is then.
+ */
+static int expr_balance(struct expr *e) {
+  vec_expr_t items = vec_init();
+  vec(vec_expr_t) links = vec_init(); /* operands of the comma nodes */
+  struct expr *n;
+  int i;
+  for (n = e, i = 0; n->type == OP_COMMA && i < EXPR_BALANCE_MIN; i++) {
+    n = &vec_nth(&n->param.op.args, 1);
+  }
+  if (i < EXPR_BALANCE_MIN) {
+    return 0;
+  }
+  for (n = e; n->type == OP_COMMA; n = &vec_nth(&n->param.op.args, 1)) {
+    if (vec_push(&items, vec_nth(&n->param.op.args, 0)) == -1 ||
+        vec_push(&links, n->param.op.args) == -1) {
+      goto fail;
+    }
   }
+  if (vec_push(&items, *n) == -1) {
+    goto fail;
+  }
+  *e = expr_join(&items, links.buf);
+  vec_free(&items);
+  vec_free(&links);
   return 0;
+fail:
+  vec_free(&items);
+  vec_free(&links);
+  return -1;
 }
 
-static struct expr expr_const(float value) {
+static struct expr expr_const(expr_num_t value) {
   struct expr e = expr_init();
   e.type = OP_CONST;
   e.param.num.value = value;
@@ -542,95 +1070,444 @@ static struct expr expr_varref(struct expr_var *v) {
   return e;
 }
 
-static struct expr expr_binary(enum expr_type type, struct expr a,
-                               struct expr b) {
-  struct expr e = expr_init();
-  e.type = type;
-  vec_push(&e.param.op.args, a);
-  vec_push(&e.param.op.args, b);
-  return e;
+#define EXPR_CHAIN_MIN 256
+
+/*
+ * Bitwise operators and shifts are not chained: their integer operands would
+ * be rounded to float through a variable, which expr_eval_int() avoids.
+ */
+static int expr_is_chain(enum expr_type op) {
+  return (expr_is_unary(op) || expr_is_binary(op)) && op != OP_ASSIGN &&
+         op != OP_COMMA && !expr_is_int(op);
 }
 
-static inline void expr_copy(struct expr *dst, struct expr *src) {
-  int i;
-  struct expr arg;
-  dst->type = src->type;
-  if (src->type == OP_FUNC) {
-    dst->param.func.f = src->param.func.f;
-    vec_foreach(&src->param.func.args, arg, i) {
-      struct expr tmp = expr_init();
-      expr_copy(&tmp, &arg);
-      vec_push(&dst->param.func.args, tmp);
-    }
-    if (src->param.func.f->ctxsz > 0) {
-      dst->param.func.context = calloc(1, src->param.func.f->ctxsz);
-    }
-  } else if (src->type == OP_CONST) {
-    dst->param.num.value = src->param.num.value;
-  } else if (src->type == OP_VAR) {
-    dst->param.var.value = src->param.var.value;
-  } else {
-    vec_foreach(&src->param.op.args, arg, i) {
-      struct expr tmp = expr_init();
-      expr_copy(&tmp, &arg);
-      vec_push(&dst->param.op.args, tmp);
+/*
+ * Operators like a+b+c+... are nested as deep as the chain is long. Rewrites
+ * every chain of EXPR_CHAIN_MIN or more operators along the left operands
+ * into a balanced sequence "$@0 = a, $@0 = $@0 + b, ..., $@0 + z" through a
+ * hidden variable of the list, one per chain, see expr_var_temp(). Operands
+ * are evaluated in the same order and results are the same. Right operands
+ * nested as deep, like a+(b+(c+...)), and integer chains are kept. Returns -1 if memory can not
+ * be allocated, the tree evaluates the same then, with some chains left.
+ */
+static int expr_unchain(struct expr *e, struct expr_var_list *vars,
+                        struct expr_arena *arena) {
+  vec(struct expr *) stack = vec_init();
+  vec_expr_t spine = vec_init(); /* chain operators from the outermost */
+  vec_expr_t items = vec_init();
+  vec_expr_t *links = NULL; /* comma operands, then assignment operands */
+  struct expr_var *v;
+  struct expr *n;
+  int i, len, status = -1;
+  if (vec_push(&stack, e) == -1) {
+    goto done;
+  }
+  while (vec_len(&stack) > 0) {
+    e = vec_pop(&stack);
+    for (n = e, len = 0; expr_is_chain(n->type) && len < EXPR_CHAIN_MIN; len++) {
+      n = &vec_nth(&n->param.op.args, 0);
+    }
+    if (len < EXPR_CHAIN_MIN) {
+      vec_expr_t *args =
+          (e->type == OP_FUNC ? &e->param.func.args : &e->param.op.args);
+      if (e->type == OP_CONST || e->type == OP_VAR) {
+        continue;
+      }
+      for (i = 0; i < vec_len(args); i++) {
+        if (vec_push(&stack, &vec_nth(args, i)) == -1) {
+          goto done;
+        }
+      }
+      continue;
+    }
+    spine.len = items.len = 0;
+    for (n = e; expr_is_chain(n->type); n = &vec_nth(&n->param.op.args, 0)) {
+      if (vec_push(&spine, *n) == -1) {
+        goto done;
+      }
+    }
+    len = vec_len(&spine);
+    v = expr_var_temp(vars);
+    links = (vec_expr_t *)calloc(2 * len, sizeof(vec_expr_t));
+    if (v == NULL || links == NULL) {
+      goto done;
+    }
+    for (i = 0; i < 2 * len; i++) {
+      if (expr_alloc_args(arena, &links[i], 2) == -1) {
+        goto done;
+      }
+    }
+    /* The innermost operand is assigned first, the outermost operator last */
+    for (i = len; i > 0; i--) {
+      struct expr assign = expr_init();
+      assign.type = OP_ASSIGN;
+      assign.param.op.args = links[2 * len - i];
+      vec_nth(&assign.param.op.args, 0) = expr_varref(v);
+      vec_nth(&assign.param.op.args, 1) = (i == len ? *n : vec_nth(&spine, i));
+      if (vec_push(&items, assign) == -1) {
+        goto done;
+      }
+    }
+    if (vec_push(&items, vec_nth(&spine, 0)) == -1) {
+      goto done;
+    }
+    for (i = 0; i < len; i++) {
+      vec_nth(&vec_nth(&spine, i).param.op.args, 0) = expr_varref(v);
+    }
+    *e = expr_join(&items, links);
+    free(links);
+    links = NULL;
+    if (vec_push(&stack, e) == -1) {
+      goto done;
+    }
+  }
+  status = 0;
+done:
+  if (links != NULL && arena == NULL) {
+    for (i = 0; i < 2 * len; i++) {
+      vec_free(&links[i]);
     }
   }
+  free(links);
+  vec_free(&stack);
+  vec_free(&spine);
+  vec_free(&items);
+  return status;
 }
 
 static void expr_destroy_args(struct expr *e);
+static void expr_destroy(struct expr *e, struct expr_var_list *vars);
 
-static struct expr *expr_create(const char *s, size_t len,
-                                struct expr_var_list *vars,
-                                struct expr_func *funcs) {
-  float num;
-  struct expr_var *v;
-  const char *id = NULL;
-  size_t idn = 0;
+/*
+ * Macros: $(name, body...) is compiled once and calls of the macro are
+ * function calls sharing its body. Parameters $1 ... $99 in the body are
+ * variables of the macro, set from the arguments of every call (0 if the
+ * argument is missing). Call sites keep the macro alive.
+ */
+#define EXPR_MACRO_PARAMS 99
 
-  struct expr *result = NULL;
+typedef vec(expr_num_t *) vec_value_t;
 
-  vec_expr_t es = vec_init();
-  vec_str_t os = vec_init();
-  vec_arg_t as = vec_init();
+struct expr_macro {
+  struct expr_func func; /* call sites are bound to it */
+  struct expr body;      /* bodies joined with commas */
+  struct expr_var_list params;
+  expr_num_t **slots; /* value of $1, $2, ... or NULL if not used */
+  vec_value_t assigned; /* variables assigned by every call */
+  int nparams;
+  int refs; /* call sites and the parser */
+  char name[];
+};
 
-  struct macro {
-    char *name;
-    vec_expr_t body;
-  };
-  vec(struct macro) macros = vec_init();
+/* Parser's table of macros, later definitions replace earlier ones */
+struct expr_macro_table {
+  vec(struct expr_macro *) all; /* every definition, released after parsing */
+  struct expr_macro **index;
+  int size; /* table size, power of two */
+};
 
-  int flags = EXPR_TDEFAULT;
-  int paren = EXPR_PAREN_ALLOWED;
-  for (;;) {
-    int n = expr_next_token(s, len, &flags);
-    if (n == 0) {
-      break;
+static expr_num_t expr_macro_call(struct expr_func *f, vec_expr_t *args,
+                                  void *c) {
+  struct expr_macro *m = (struct expr_macro *)f;
+  expr_num_t values[EXPR_MACRO_PARAMS], saved[EXPR_MACRO_PARAMS], result;
+  int i;
+  (void)c;
+  /* Arguments can call the macro too, so they are all evaluated first */
+  for (i = 0; i < vec_len(args); i++) {
+    expr_num_t value = expr_eval(&vec_nth(args, i));
+    if (i < m->nparams) {
+      values[i] = value;
+    }
+  }
+  /* Parameters of an outer call of the same macro are restored after it */
+  for (i = 0; i < m->nparams; i++) {
+    if (m->slots[i] != NULL) {
+      saved[i] = *m->slots[i];
+      *m->slots[i] = (i < vec_len(args) ? values[i] : 0);
+    }
+  }
+  result = expr_eval(&m->body);
+  for (i = 0; i < m->nparams; i++) {
+    if (m->slots[i] != NULL) {
+      *m->slots[i] = saved[i];
+    }
+  }
+  return result;
+}
+
+static void expr_macro_release(struct expr_macro *m) {
+  if (--m->refs > 0) {
+    return;
+  }
+#if JIT
+  expr_jit_release(&m->body);
+#endif
+  expr_destroy_args(&m->body);
+  expr_destroy(NULL, &m->params);
+  vec_free(&m->assigned);
+  free(m->slots);
+  free(m);
+}
+
+static void expr_macro_cleanup(struct expr_func *f, void *c) {
+  (void)c;
+  expr_macro_release((struct expr_macro *)f);
+}
+
+/* Returns index of the parameter $1 ... $99 or -1 */
+static int expr_macro_param(const char *name) {
+  if (name[0] != '$' || name[1] < '1' || name[1] > '9') {
+    return -1;
+  } else if (name[2] == '\0') {
+    return name[1] - '1';
+  } else if (isdigit(name[2]) && name[3] == '\0') {
+    return (name[1] - '0') * 10 + (name[2] - '0') - 1;
+  }
+  return -1;
+}
+
+/*
+ * Rebinds parameters of the body to the macro variables. Returns 1 if the
+ * body depends only on parameters, 0 if not, -1 if memory can't be allocated.
+ */
+static int expr_macro_bind(struct expr_macro *m, struct expr *e) {
+  int i, k, pure = 1;
+  vec_expr_t *args = &e->param.op.args;
+  if (e->type == OP_CONST || e->type == OP_UNKNOWN) {
+    return 1;
+  } else if (e->type == OP_VAR) {
+    const char *name = expr_var_of(e->param.var.value)->name;
+    struct expr_var *v;
+    if ((k = expr_macro_param(name)) == -1) {
+      return 0;
+    }
+    v = expr_var(&m->params, name, strlen(name));
+    if (v == NULL) {
+      return -1;
+    }
+    e->param.var.value = &v->value;
+    m->nparams = (k + 1 > m->nparams ? k + 1 : m->nparams);
+    return 1;
+  } else if (e->type == OP_FUNC) {
+    args = &e->param.func.args;
+    pure = e->param.func.f->pure;
+  } else if (e->type == OP_ASSIGN) {
+    pure = 0;
+  }
+  for (i = 0; i < vec_len(args); i++) {
+    k = expr_macro_bind(m, &vec_nth(args, i));
+    if (k == -1) {
+      return -1;
+    }
+    pure = pure && k;
+  }
+  return pure;
+}
+
+static int expr_is_assigned(vec_value_t *assigned, expr_num_t *value) {
+  for (int i = 0; i < vec_len(assigned); i++) {
+    if (vec_nth(assigned, i) == value) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Collects variables that are assigned anywhere in the expression, including
+ * bodies of the macros it calls.
+ */
+static int expr_assigned(vec_value_t *assigned, struct expr *e) {
+  int i;
+  vec_expr_t *args = &e->param.op.args;
+  if (e->type == OP_CONST || e->type == OP_VAR || e->type == OP_UNKNOWN) {
+    return 0;
+  } else if (e->type == OP_FUNC) {
+    args = &e->param.func.args;
+    if (e->param.func.f->f == expr_macro_call) {
+      /* Body of the macro assigns its variables at every call */
+      vec_value_t *body = &((struct expr_macro *)e->param.func.f)->assigned;
+      for (i = 0; i < vec_len(body); i++) {
+        if (!expr_is_assigned(assigned, vec_nth(body, i)) &&
+            vec_push(assigned, vec_nth(body, i)) == -1) {
+          return -1;
+        }
+      }
+    }
+  } else if (e->type == OP_ASSIGN && vec_nth(args, 0).type == OP_VAR &&
+             !expr_is_assigned(assigned, vec_nth(args, 0).param.var.value) &&
+             vec_push(assigned, vec_nth(args, 0).param.var.value) == -1) {
+    return -1;
+  }
+  for (i = 0; i < vec_len(args); i++) {
+    if (expr_assigned(assigned, &vec_nth(args, i)) == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Compiles $(name, body...) from the arguments, which are always consumed.
+ * Returns NULL if memory can not be allocated.
+ */
+static struct expr_macro *expr_macro_create(vec_expr_t *args,
+                                            struct expr_arena *arena) {
+  const char *name = expr_var_of(vec_nth(args, 0).param.var.value)->name;
+  struct expr_macro *m = (struct expr_macro *)calloc(
+      1, sizeof(struct expr_macro) + strlen(name) + 1);
+  int i = vec_len(args) - 1, pure = -1;
+  if (m != NULL) {
+    strcpy(m->name, name);
+    m->func.name = m->name;
+    m->func.f = expr_macro_call;
+    m->func.cleanup = expr_macro_cleanup;
+    m->func.ctxsz = 1; /* only to release the macro when a call is destroyed */
+    m->refs = 1;
+    m->body = expr_const(0);
+    for (; i > 0; i--) {
+      struct expr comma = expr_init();
+      comma.type = OP_COMMA;
+      if (i == vec_len(args) - 1) {
+        m->body = vec_nth(args, i);
+      } else if (expr_alloc_args(arena, &comma.param.op.args, 2) == 0) {
+        vec_nth(&comma.param.op.args, 0) = vec_nth(args, i);
+        vec_nth(&comma.param.op.args, 1) = m->body;
+        m->body = comma;
+      } else {
+        break; /* allocation failed */
+      }
+    }
+  }
+  for (; i > 0; i--) {
+    expr_destroy_args(&vec_nth(args, i));
+  }
+  args->len = 1; /* the rest belongs to the body now */
+  if (m != NULL && i == 0) {
+    (void)expr_balance(&m->body); /* a chain still works if it fails */
+    pure = expr_macro_bind(m, &m->body);
+  }
+  if (pure != -1 && m->nparams > 0) {
+    m->slots = (expr_num_t **)calloc(m->nparams, sizeof(expr_num_t *));
+    pure = (m->slots == NULL ? -1 : pure);
+  }
+  if (pure == -1) {
+    if (m != NULL) {
+      expr_macro_release(m);
+    }
+    return NULL;
+  }
+  for (struct expr_var *v = m->params.head; v; v = v->next) {
+    m->slots[expr_macro_param(v->name)] = &v->value;
+  }
+  if (expr_assigned(&m->assigned, &m->body) == -1) {
+    expr_macro_release(m);
+    return NULL;
+  }
+  m->func.pure = pure;
+#if JIT
+  m->body.fn = expr_compile(&m->body, &m->body.jitsz);
+#endif
+  return m;
+}
+
+static struct expr_macro *expr_macro_find(struct expr_macro_table *t,
+                                          const char *s, size_t len) {
+  unsigned int mask = t->size - 1;
+  if (t->index == NULL) {
+    return NULL;
+  }
+  for (unsigned int i = expr_hash(s, len) & mask; t->index[i];
+       i = (i + 1) & mask) {
+    if (strncmp(t->index[i]->name, s, len) == 0 &&
+        t->index[i]->name[len] == '\0') {
+      return t->index[i];
+    }
+  }
+  return NULL;
+}
+
+static void expr_macro_index(struct expr_macro_table *t,
+                             struct expr_macro *m) {
+  unsigned int mask = t->size - 1;
+  unsigned int i = expr_hash(m->name, strlen(m->name)) & mask;
+  while (t->index[i] != NULL && strcmp(t->index[i]->name, m->name) != 0) {
+    i = (i + 1) & mask;
+  }
+  t->index[i] = m;
+}
+
+/* Takes the parser's reference of the macro, returns -1 on failure */
+static int expr_macro_add(struct expr_macro_table *t, struct expr_macro *m) {
+  if (vec_push(&t->all, m) == -1) {
+    expr_macro_release(m);
+    return -1;
+  }
+  if (vec_len(&t->all) * 2 > t->size) {
+    /* Rebuilt in definition order, so later definitions still win */
+    int size = (t->size > 0 ? t->size * 2 : 16);
+    struct expr_macro **index =
+        (struct expr_macro **)calloc(size, sizeof(struct expr_macro *));
+    if (index == NULL) {
+      return -1; /* allocation failed */
+    }
+    free(t->index);
+    t->index = index;
+    t->size = size;
+    for (int i = 0; i < vec_len(&t->all) - 1; i++) {
+      expr_macro_index(t, vec_nth(&t->all, i));
+    }
+  }
+  expr_macro_index(t, m);
+  return 0;
+}
+
+static void expr_macro_table_free(struct expr_macro_table *t) {
+  int i;
+  struct expr_macro *m;
+  vec_foreach(&t->all, m, i) { expr_macro_release(m); }
+  vec_free(&t->all);
+  free(t->index);
+}
+
+static struct expr *expr_create_ex(const char *s, size_t len,
+                                   struct expr_var_list *vars,
+                                   struct expr_func_registry *funcs,
+                                   struct expr_arena *arena) {
+  expr_num_t num;
+  struct expr_var *v;
+  struct expr_func *f = NULL;
+  const char *id = NULL;
+  size_t idn = 0;
+
+  struct expr *result = NULL;
+
+  vec_expr_t es = vec_init();
+  vec_str_t os = vec_init();
+  vec_arg_t as = vec_init();
+
+  struct expr_macro_table macros = {vec_init(), NULL, 0};
+
+  int flags = EXPR_TDEFAULT;
+  int paren = EXPR_PAREN_ALLOWED;
+  for (;;) {
+    int n = expr_next_token(s, len, &flags);
+    if (n == 0) {
+      break;
     } else if (n < 0) {
       goto cleanup;
     }
     const char *tok = s;
+    enum expr_type op = OP_UNKNOWN;
     s = s + n;
     len = len - n;
     if (*tok == '#') {
       continue;
     }
     if (flags & EXPR_UNARY) {
-      if (n == 1) {
-        switch (*tok) {
-        case '-':
-          tok = "-u";
-          break;
-        case '^':
-          tok = "^u";
-          break;
-        case '!':
-          tok = "!u";
-          break;
-        default:
-          goto cleanup;
-        }
-        n = 2;
+      op = expr_op(tok, n, 1);
+      if (op == OP_UNKNOWN) {
+        goto cleanup;
       }
     }
     if (*tok == '\n' && (flags & EXPR_COMMA)) {
@@ -645,18 +1522,11 @@ static struct expr *expr_create(const char *s, size_t len,
 
     if (idn > 0) {
       if (n == 1 && *tok == '(') {
-        int i;
-        int has_macro = 0;
-        struct macro m;
-        vec_foreach(&macros, m, i) {
-          if (strlen(m.name) == idn && strncmp(m.name, id, idn) == 0) {
-            has_macro = 1;
-            break;
-          }
-        }
-        if ((idn == 1 && id[0] == '$') || has_macro ||
-            expr_func(funcs, id, idn) != NULL) {
-          struct expr_string str = {id, (int)idn};
+        /* Macros hide functions of the same name */
+        struct expr_macro *m = expr_macro_find(&macros, id, idn);
+        f = (m != NULL ? &m->func : expr_func_lookup(funcs, id, idn));
+        if ((idn == 1 && id[0] == '$') || f != NULL) {
+          struct expr_string str = {id, (int)idn, OP_UNKNOWN};
           vec_push(&os, str);
           paren = EXPR_PAREN_EXPECTED;
         } else {
@@ -672,12 +1542,12 @@ static struct expr *expr_create(const char *s, size_t len,
 
     if (n == 1 && *tok == '(') {
       if (paren == EXPR_PAREN_EXPECTED) {
-        struct expr_string str = {"{", 1};
+        struct expr_string str = {"{", 1, OP_UNKNOWN};
         vec_push(&os, str);
-        struct expr_arg arg = {vec_len(&os), vec_len(&es), vec_init()};
+        struct expr_arg arg = {vec_len(&os), vec_len(&es), vec_init(), f};
         vec_push(&as, arg);
       } else if (paren == EXPR_PAREN_ALLOWED) {
-        struct expr_string str = {"(", 1};
+        struct expr_string str = {"(", 1, OP_UNKNOWN};
         vec_push(&os, str);
       } else {
         goto cleanup; // Bad call
@@ -689,7 +1559,7 @@ static struct expr *expr_create(const char *s, size_t len,
       while (vec_len(&os) > minlen && *vec_peek(&os).s != '(' &&
              *vec_peek(&os).s != '{') {
         struct expr_string str = vec_pop(&os);
-        if (expr_bind(str.s, str.n, &es) == -1) {
+        if (expr_bind(str.op, &es, arena) == -1) {
           goto cleanup;
         }
       }
@@ -713,75 +1583,60 @@ static struct expr *expr_create(const char *s, size_t len,
             vec_free(&arg.args);
             goto cleanup; /* first argument is not a variable */
           }
-          for (struct expr_var *v = vars->head; v; v = v->next) {
-            if (&v->value == u->param.var.value) {
-              struct macro m = {v->name, arg.args};
-              vec_push(&macros, m);
-              break;
-            }
+          int k = 1;
+          while (k < vec_len(&arg.args) &&
+                 expr_unchain(&vec_nth(&arg.args, k), vars, arena) == 0) {
+            k++;
+          }
+          k = (k < vec_len(&arg.args)); /* failed, the body is still consumed */
+          struct expr_macro *m = expr_macro_create(&arg.args, arena);
+          vec_free(&arg.args);
+          if (m != NULL && k) {
+            expr_macro_release(m);
+            m = NULL;
+          }
+          if (m == NULL || expr_macro_add(&macros, m) == -1) {
+            goto cleanup;
           }
           vec_push(&es, expr_const(0));
         } else {
-          int i = 0;
-          int found = -1;
-          struct macro m;
-          vec_foreach(&macros, m, i) {
-            if (strlen(m.name) == (size_t)str.n &&
-                strncmp(m.name, str.s, str.n) == 0) {
-              found = i;
-            }
-          }
-          if (found != -1) {
-            m = vec_nth(&macros, found);
-            struct expr root = expr_const(0);
-            struct expr *p = &root;
-            /* Assign macro parameters */
-            for (int j = 0; j < vec_len(&arg.args); j++) {
-              char varname[4];
-              snprintf(varname, sizeof(varname) - 1, "$%d", (j + 1));
-              struct expr_var *v = expr_var(vars, varname, strlen(varname));
-              struct expr ev = expr_varref(v);
-              struct expr assign =
-                  expr_binary(OP_ASSIGN, ev, vec_nth(&arg.args, j));
-              *p = expr_binary(OP_COMMA, assign, expr_const(0));
-              p = &vec_nth(&p->param.op.args, 1);
+          f = arg.f;
+          struct expr bound_func = expr_init();
+          bound_func.type = OP_FUNC;
+          bound_func.param.func.f = f;
+          bound_func.param.func.args = arg.args;
+          if (arena != NULL) {
+            /* Move arguments into the arena */
+            vec_expr_t *args = &bound_func.param.func.args;
+            if (expr_alloc_args(arena, args, vec_len(&arg.args)) == -1) {
+              vec_free(&arg.args);
+              goto cleanup; /* allocation failed */
             }
-            /* Expand macro body */
-            for (int j = 1; j < vec_len(&m.body); j++) {
-              if (j < vec_len(&m.body) - 1) {
-                *p = expr_binary(OP_COMMA, expr_const(0), expr_const(0));
-                expr_copy(&vec_nth(&p->param.op.args, 0), &vec_nth(&m.body, j));
-              } else {
-                expr_copy(p, &vec_nth(&m.body, j));
-              }
-              p = &vec_nth(&p->param.op.args, 1);
+            for (int j = 0; j < vec_len(args); j++) {
+              vec_nth(args, j) = vec_nth(&arg.args, j);
             }
-            vec_push(&es, root);
             vec_free(&arg.args);
-          } else {
-            struct expr_func *f = expr_func(funcs, str.s, str.n);
-            struct expr bound_func = expr_init();
-            bound_func.type = OP_FUNC;
-            bound_func.param.func.f = f;
-            bound_func.param.func.args = arg.args;
-            if (f->ctxsz > 0) {
-              void *p = calloc(1, f->ctxsz);
-              if (p == NULL) {
-                goto cleanup; /* allocation failed */
-              }
-              bound_func.param.func.context = p;
+          }
+          if (f->ctxsz > 0) {
+            void *p = expr_alloc_context(arena, f);
+            if (p == NULL) {
+              goto cleanup; /* allocation failed */
             }
-            vec_push(&es, bound_func);
+            bound_func.param.func.context = p;
+          }
+          if (f->f == expr_macro_call) {
+            ((struct expr_macro *)f)->refs++;
           }
+          vec_push(&es, bound_func);
         }
       }
       paren_next = EXPR_PAREN_FORBIDDEN;
-    } else if (!isnan(num = expr_parse_number(tok, n))) {
+    } else if (expr_parse_number(tok, n, &num) == 0) {
       vec_push(&es, expr_const(num));
       paren_next = EXPR_PAREN_FORBIDDEN;
-    } else if (expr_op(tok, n, -1) != OP_UNKNOWN) {
-      enum expr_type op = expr_op(tok, n, -1);
-      struct expr_string o2 = {NULL, 0};
+    } else if (op != OP_UNKNOWN ||
+               (op = expr_op(tok, n, -1)) != OP_UNKNOWN) {
+      struct expr_string o2 = {NULL, 0, OP_UNKNOWN};
       if (vec_len(&os) > 0) {
         o2 = vec_peek(&os);
       }
@@ -794,14 +1649,13 @@ static struct expr *expr_create(const char *s, size_t len,
             break;
           }
         }
-        enum expr_type type2 = expr_op(o2.s, o2.n, -1);
-        if (!(type2 != OP_UNKNOWN && expr_prec(op, type2))) {
-          struct expr_string str = {tok, n};
+        if (!(o2.op != OP_UNKNOWN && expr_prec(op, o2.op))) {
+          struct expr_string str = {tok, n, op};
           vec_push(&os, str);
           break;
         }
 
-        if (expr_bind(o2.s, o2.n, &es) == -1) {
+        if (expr_bind(o2.op, &es, arena) == -1) {
           goto cleanup;
         }
         (void)vec_pop(&os);
@@ -809,6 +1663,7 @@ static struct expr *expr_create(const char *s, size_t len,
           o2 = vec_peek(&os);
         } else {
           o2.n = 0;
+          o2.op = OP_UNKNOWN;
         }
       }
     } else {
@@ -832,31 +1687,45 @@ static struct expr *expr_create(const char *s, size_t len,
     if (rest.n == 1 && (*rest.s == '(' || *rest.s == ')')) {
       goto cleanup; // Bad paren
     }
-    if (expr_bind(rest.s, rest.n, &es) == -1) {
+    if (expr_bind(rest.op, &es, arena) == -1) {
       goto cleanup;
     }
   }
 
-  result = (struct expr *)calloc(1, sizeof(struct expr));
+  if (vec_len(&es) > 0 &&
+      expr_unchain(&vec_peek(&es), vars, arena) == -1) {
+    goto cleanup;
+  }
+
+  if (arena != NULL) {
+    result = (struct expr *)expr_arena_alloc(arena, sizeof(struct expr));
+#if JIT
+    if (result != NULL && vec_push(&arena->roots, result) == -1) {
+      result = NULL;
+    }
+#endif
+  } else {
+    result = (struct expr *)calloc(1, sizeof(struct expr));
+  }
   if (result != NULL) {
     if (vec_len(&es) == 0) {
       result->type = OP_CONST;
     } else {
       *result = vec_pop(&es);
+      (void)expr_balance(result); /* a chain still works if it fails */
     }
+#if JIT
+    result->fn = expr_compile(result, &result->jitsz);
+    result->batchfn = expr_compile_batch(result, &result->batchsz);
+#endif
   }
 
   int i, j;
-  struct macro m;
   struct expr e;
   struct expr_arg a;
 cleanup:
-  vec_foreach(&macros, m, i) {
-    struct expr e;
-    vec_foreach(&m.body, e, j) { expr_destroy_args(&e); }
-    vec_free(&m.body);
-  }
-  vec_free(&macros);
+  /* Macros that are called live on in the expression */
+  expr_macro_table_free(&macros);
 
   vec_foreach(&es, e, i) { expr_destroy_args(&e); }
   vec_free(&es);
@@ -872,26 +1741,71 @@ cleanup:
   return result;
 }
 
+static struct expr *expr_create_arena(const char *s, size_t len,
+                                      struct expr_var_list *vars,
+                                      struct expr_func *funcs,
+                                      struct expr_arena *arena) {
+  struct expr_func_registry r = {funcs, NULL, 0};
+  return expr_create_ex(s, len, vars, &r, arena);
+}
+
+static struct expr *expr_create(const char *s, size_t len,
+                                struct expr_var_list *vars,
+                                struct expr_func *funcs) {
+  return expr_create_arena(s, len, vars, funcs, NULL);
+}
+
+/*
+ * The last operand that is not a leaf is released in a loop and the others
+ * recursively, so long chains like a+b+c+... or a,b,c,... don't use the stack.
+ */
 static void expr_destroy_args(struct expr *e) {
-  int i;
-  struct expr arg;
-  if (e->type == OP_FUNC) {
-    vec_foreach(&e->param.func.args, arg, i) { expr_destroy_args(&arg); }
-    vec_free(&e->param.func.args);
-    if (e->param.func.context != NULL) {
-      if (e->param.func.f->cleanup != NULL) {
-        e->param.func.f->cleanup(e->param.func.f, e->param.func.context);
+  struct expr node = *e, next;
+  int i, last;
+  for (;;) {
+    vec_expr_t *args = &node.param.op.args;
+    if (node.type == OP_FUNC) {
+      args = &node.param.func.args;
+      if (expr_arena_owned(args)) {
+        return; /* context is released by the arena */
+      }
+      if (node.param.func.context != NULL) {
+        if (node.param.func.f->cleanup != NULL) {
+          node.param.func.f->cleanup(node.param.func.f,
+                                     node.param.func.context);
+        }
+        free(node.param.func.context);
+      }
+    } else if (node.type == OP_CONST || node.type == OP_VAR) {
+      return;
+    }
+    for (last = vec_len(args) - 1; last >= 0; last--) {
+      enum expr_type type = vec_nth(args, last).type;
+      if (type != OP_CONST && type != OP_VAR) {
+        break;
+      }
+    }
+    for (i = 0; i < vec_len(args); i++) {
+      if (i != last) {
+        expr_destroy_args(&vec_nth(args, i));
       }
-      free(e->param.func.context);
     }
-  } else if (e->type != OP_CONST && e->type != OP_VAR) {
-    vec_foreach(&e->param.op.args, arg, i) { expr_destroy_args(&arg); }
-    vec_free(&e->param.op.args);
+    if (last == -1) {
+      expr_free_args(args);
+      return;
+    }
+    e = &vec_nth(args, last);
+    next = *e;
+    expr_free_args(args);
+    node = next;
   }
 }
 
 static void expr_destroy(struct expr *e, struct expr_var_list *vars) {
   if (e != NULL) {
+#if JIT
+    expr_jit_release(e);
+#endif
     expr_destroy_args(e);
     free(e);
   }
@@ -901,7 +1815,3077 @@ static void expr_destroy(struct expr *e, struct expr_var_list *vars) {
       free(v);
       v = next;
     }
+    for (struct expr_var *v = vars->temps; v;) {
+      struct expr_var *next = v->next;
+      free(v);
+      v = next;
+    }
+    free(vars->index);
+    memset(vars, 0, sizeof(*vars));
+  }
+}
+
+/* Releases all expressions created in the arena */
+EXPR_UNUSED
+static void expr_arena_free(struct expr_arena *a) {
+  struct expr_arena_cleanup *c;
+#if JIT
+  int i;
+  struct expr *e;
+  vec_foreach(&a->roots, e, i) { expr_jit_release(e); }
+  vec_free(&a->roots);
+#endif
+  for (c = a->cleanups; c; c = c->next) {
+    c->f->cleanup(c->f, c->context);
+  }
+  a->cleanups = NULL;
+  while (a->head != NULL) {
+    struct expr_arena_block *next = a->head->next;
+    free(a->head);
+    a->head = next;
+  }
+}
+
+/*
+ * Cache of compiled expressions keyed by source text and environment
+ * (variable list and function registry). Entries are shared and reference
+ * counted, the least recently used unreferenced entry is evicted by the CLOCK
+ * algorithm when the cache is full.
+ */
+struct expr_cache_entry {
+  struct expr *e;
+  int refs;
+  int slot; /* position on the clock, -1 if the entry is not cached */
+  int used; /* reference bit of the clock */
+  unsigned int hash;
+  struct expr_var_list *vars;
+  struct expr_func_registry *funcs;
+  struct expr_cache_entry *next; /* next entry in the same bucket */
+  size_t len;
+  char s[];
+};
+
+struct expr_cache {
+  struct expr_cache_entry **buckets;
+  struct expr_cache_entry **clock;
+  int size; /* number of buckets, power of two */
+  int cap;
+  int len;
+  int hand;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+};
+
+EXPR_UNUSED
+static int expr_cache_init(struct expr_cache *c, int cap) {
+  memset(c, 0, sizeof(*c));
+  c->cap = (cap > 0 ? cap : 1);
+  c->size = 16;
+  while (c->size < c->cap) {
+    c->size = c->size * 2;
+  }
+  c->buckets = (struct expr_cache_entry **)calloc(
+      c->size, sizeof(struct expr_cache_entry *));
+  c->clock = (struct expr_cache_entry **)calloc(
+      c->cap, sizeof(struct expr_cache_entry *));
+  if (c->buckets == NULL || c->clock == NULL) {
+    free(c->buckets);
+    free(c->clock);
+    return -1; /* allocation failed */
+  }
+  return 0;
+}
+
+static void expr_cache_unlink(struct expr_cache *c,
+                              struct expr_cache_entry *p) {
+  struct expr_cache_entry **pp = &c->buckets[p->hash & (c->size - 1)];
+  while (*pp != p) {
+    pp = &(*pp)->next;
+  }
+  *pp = p->next;
+}
+
+/* Frees a clock slot, returns -1 if all entries are referenced */
+static int expr_cache_evict(struct expr_cache *c) {
+  for (int i = 0; i < c->cap * 2; i++) {
+    struct expr_cache_entry *p = c->clock[c->hand];
+    int slot = c->hand;
+    c->hand = (c->hand + 1) % c->cap;
+    if (p->refs > 0) {
+      continue;
+    } else if (p->used) {
+      p->used = 0;
+      continue;
+    }
+    expr_cache_unlink(c, p);
+    expr_destroy(p->e, NULL);
+    free(p);
+    c->evictions++;
+    return slot;
+  }
+  return -1;
+}
+
+/* Returns referenced entry for the expression, compiling it on a miss */
+EXPR_UNUSED
+static struct expr_cache_entry *
+expr_cache_get(struct expr_cache *c, const char *s, size_t len,
+               struct expr_var_list *vars, struct expr_func_registry *funcs) {
+  struct expr_func_registry none = {NULL, NULL, 0};
+  unsigned int hash = expr_hash(s, len);
+  struct expr_cache_entry *p;
+  for (p = c->buckets[hash & (c->size - 1)]; p; p = p->next) {
+    if (p->hash == hash && p->len == len && p->vars == vars &&
+        p->funcs == funcs && memcmp(p->s, s, len) == 0) {
+      p->refs++;
+      p->used = 1;
+      c->hits++;
+      return p;
+    }
+  }
+  c->misses++;
+  p = (struct expr_cache_entry *)calloc(1, sizeof(*p) + len);
+  if (p == NULL) {
+    return NULL; /* allocation failed */
+  }
+  p->e = expr_create_ex(s, len, vars, funcs != NULL ? funcs : &none, NULL);
+  if (p->e == NULL) {
+    free(p);
+    return NULL;
+  }
+  p->refs = 1;
+  p->hash = hash;
+  p->vars = vars;
+  p->funcs = funcs;
+  p->len = len;
+  memcpy(p->s, s, len);
+  p->slot = (c->len < c->cap ? c->len++ : expr_cache_evict(c));
+  if (p->slot != -1) {
+    /* Cache is full of referenced entries otherwise */
+    c->clock[p->slot] = p;
+    p->next = c->buckets[hash & (c->size - 1)];
+    c->buckets[hash & (c->size - 1)] = p;
+  }
+  return p;
+}
+
+EXPR_UNUSED
+static void expr_cache_put(struct expr_cache *c, struct expr_cache_entry *p) {
+  (void)c;
+  if (--p->refs == 0 && p->slot == -1) {
+    expr_destroy(p->e, NULL);
+    free(p);
+  }
+}
+
+/* Destroys all cached expressions, they must not be referenced anymore */
+EXPR_UNUSED
+static void expr_cache_free(struct expr_cache *c) {
+  for (int i = 0; i < c->len; i++) {
+    expr_destroy(c->clock[i]->e, NULL);
+    free(c->clock[i]);
+  }
+  free(c->buckets);
+  free(c->clock);
+  memset(c, 0, sizeof(*c));
+}
+
+/*
+ * Optimizations. EXPR_OPT_ALGEBRA turns x**2 into x*x only if the base is a
+ * variable or a constant, there is no variable to evaluate another base into
+ * once. Squares of any pure base are rewritten by expr_cse().
+ */
+#define EXPR_OPT_FOLD (1 << 0)    /* fold constant subtrees, bit-exact */
+#define EXPR_OPT_ALGEBRA (1 << 1) /* identities, may change sign of zero */
+#define EXPR_OPT_ALL (EXPR_OPT_FOLD | EXPR_OPT_ALGEBRA)
+
+static int expr_is_const(struct expr *e, expr_num_t value) {
+  return e->type == OP_CONST && e->param.num.value == value;
+}
+
+/* Replace binary expression with one of its arguments */
+static void expr_keep_arg(struct expr *e, int i) {
+  struct expr keep = vec_nth(&e->param.op.args, i);
+  expr_destroy_args(&vec_nth(&e->param.op.args, 1 - i));
+  expr_free_args(&e->param.op.args);
+  *e = keep;
+}
+
+/* Returns 1 if the simplified expression is constant */
+static int expr_simplify(struct expr *e, int flags) {
+  int i;
+  int folded = 1;
+  vec_expr_t *args = &e->param.op.args;
+  if (e->type == OP_FUNC) {
+    for (i = 0; i < vec_len(&e->param.func.args); i++) {
+      folded = expr_simplify(&vec_nth(&e->param.func.args, i), flags) &&
+               folded;
+    }
+    if (!(flags & EXPR_OPT_FOLD) || !folded || !e->param.func.f->pure) {
+      return 0;
+    }
+    /* Pure functions (and macros) of constants are called only once */
+    expr_num_t value = expr_eval(e);
+    expr_destroy_args(e);
+    *e = expr_const(value);
+    return 1;
+  } else if (e->type == OP_CONST) {
+    return 1;
+  } else if (e->type == OP_VAR || e->type == OP_UNKNOWN) {
+    return 0;
+  }
+  for (i = 0; i < vec_len(args); i++) {
+    folded = expr_simplify(&vec_nth(args, i), flags) && folded;
+  }
+  if (flags & EXPR_OPT_FOLD) {
+    if (folded && e->type != OP_ASSIGN) {
+      expr_num_t value = expr_eval(e);
+      if (expr_is_int(e->type) &&
+          (double)value != (double)expr_eval_int(e)) {
+        /* Not exact as a number, folded by the enclosing node instead */
+        return 1;
+      }
+      expr_destroy_args(e);
+      *e = expr_const(value);
+      return 1;
+    }
+    if (e->type == OP_COMMA && vec_nth(args, 0).type == OP_CONST) {
+      expr_keep_arg(e, 1);
+      return 0;
+    }
+  }
+  if (flags & EXPR_OPT_ALGEBRA) {
+    struct expr *a = &vec_nth(args, 0);
+    struct expr *b = &vec_nth(args, 1);
+    switch (e->type) {
+    case OP_PLUS:
+      if (expr_is_const(b, 0)) {
+        expr_keep_arg(e, 0);
+      } else if (expr_is_const(a, 0)) {
+        expr_keep_arg(e, 1);
+      }
+      break;
+    case OP_MINUS:
+      if (expr_is_const(b, 0)) {
+        expr_keep_arg(e, 0);
+      }
+      break;
+    case OP_MULTIPLY:
+      if (expr_is_const(b, 1)) {
+        expr_keep_arg(e, 0);
+      } else if (expr_is_const(a, 1)) {
+        expr_keep_arg(e, 1);
+      }
+      break;
+    case OP_DIVIDE:
+      if (expr_is_const(b, 1)) {
+        expr_keep_arg(e, 0);
+      }
+#if !EXPR_INT64
+      else if (b->type == OP_CONST && isfinite(b->param.num.value) &&
+               b->param.num.value != 0) {
+        /* Reciprocal of a power of two is exact unless it's subnormal */
+        int exp;
+        expr_num_t r = 1 / b->param.num.value;
+        if (fabs(frexp(b->param.num.value, &exp)) == 0.5 && isnormal(r)) {
+          e->type = OP_MULTIPLY;
+          b->param.num.value = r;
+        }
+      }
+#endif
+      break;
+    case OP_POWER:
+      if (expr_is_const(b, 1)) {
+        expr_keep_arg(e, 0);
+      } else if (expr_is_const(b, 2) &&
+                 (a->type == OP_VAR || a->type == OP_CONST)) {
+        e->type = OP_MULTIPLY;
+        *b = *a;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+  return 0;
+}
+
+EXPR_UNUSED
+static void expr_optimize(struct expr *e, int flags) {
+#if JIT
+  /* Native code refers to the nodes, so it has to be compiled again */
+  int jit = (e->fn != NULL);
+  expr_jit_release(e);
+  expr_simplify(e, flags);
+  if (jit) {
+    e->fn = expr_compile(e, &e->jitsz);
+    e->batchfn = expr_compile_batch(e, &e->batchsz);
   }
+#else
+  expr_simplify(e, flags);
+#endif
+}
+
+/*
+ * Common subexpressions: structurally equal pure subtrees are evaluated once
+ * into a hidden variable at the start of the expression, every occurrence
+ * reads the variable instead.
+ */
+struct expr_cse_class {
+  struct expr *e; /* first occurrence, to compare with */
+  unsigned int hash;
+  int next;   /* next class in the bucket or -1 */
+  int count;  /* occurrences that are still evaluated */
+  int def;    /* entry moved into the hidden variable, -1 if not shared */
+  int seen;   /* sharing has been decided */
+  int square; /* both operands of a product, shared even if it's small */
+  struct expr_var *var;
+};
+
+/* Pure operator nodes in postfix order, a subtree is a range of entries */
+struct expr_cse_entry {
+  struct expr *e;
+  int cls;  /* class or -1 if the node can't be shared */
+  int size; /* entries in the subtree */
+  int state;
+};
+
+#define EXPR_CSE_DEAD 0     /* inside an occurrence that is replaced */
+#define EXPR_CSE_ALIVE 1    /* evaluated as before */
+#define EXPR_CSE_DEF 2      /* moved into the hidden variable */
+#define EXPR_CSE_REPLACED 3 /* replaced with the hidden variable */
+
+typedef vec(struct expr *) vec_expr_ptr_t;
+
+struct expr_cse {
+  vec(struct expr_cse_class) classes;
+  vec(struct expr_cse_entry) entries;
+  vec_value_t assigned; /* variables that are assigned anywhere */
+  int *buckets;
+  int nbuckets;
+};
+
+/* Returns number of nodes in the expression, including function arguments */
+static int expr_count(struct expr *e) {
+  int i, n = 1;
+  vec_expr_t *args = &e->param.op.args;
+  if (e->type == OP_CONST || e->type == OP_VAR || e->type == OP_UNKNOWN) {
+    return 1;
+  } else if (e->type == OP_FUNC) {
+    args = &e->param.func.args;
+  }
+  for (i = 0; i < vec_len(args); i++) {
+    n += expr_count(&vec_nth(args, i));
+  }
+  return n;
+}
+
+static int expr_cse_equal(struct expr *a, struct expr *b) {
+  int i;
+  vec_expr_t *x = &a->param.op.args, *y = &b->param.op.args;
+  if (a->type != b->type) {
+    return 0;
+  } else if (a->type == OP_CONST) {
+    return memcmp(&a->param.num.value, &b->param.num.value,
+                  sizeof(expr_num_t)) == 0;
+  } else if (a->type == OP_VAR) {
+    return a->param.var.value == b->param.var.value;
+  } else if (a->type == OP_FUNC) {
+    if (a->param.func.f != b->param.func.f) {
+      return 0;
+    }
+    x = &a->param.func.args;
+    y = &b->param.func.args;
+  } else if (a->type == OP_UNKNOWN) {
+    return 1;
+  }
+  if (vec_len(x) != vec_len(y)) {
+    return 0;
+  }
+  for (i = 0; i < vec_len(x); i++) {
+    if (!expr_cse_equal(&vec_nth(x, i), &vec_nth(y, i))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Returns class of the subtree, adding a new one if needed, or -1 */
+static int expr_cse_class(struct expr_cse *c, struct expr *e,
+                          unsigned int hash) {
+  struct expr_cse_class k;
+  int *b = &c->buckets[hash & (c->nbuckets - 1)];
+  for (int i = *b; i != -1; i = vec_nth(&c->classes, i).next) {
+    k = vec_nth(&c->classes, i);
+    if (k.hash == hash && expr_cse_equal(k.e, e)) {
+      vec_nth(&c->classes, i).count++;
+      return i;
+    }
+  }
+  memset(&k, 0, sizeof(k));
+  k.e = e;
+  k.hash = hash;
+  k.next = *b;
+  k.count = 1;
+  k.def = -1;
+  if (vec_push(&c->classes, k) == -1) {
+    return -1;
+  }
+  *b = vec_len(&c->classes) - 1;
+  return *b;
+}
+
+/*
+ * Hashes the subtree and adds entries for its pure operator nodes. Returns 1
+ * if the subtree is pure and doesn't read assigned variables, 0 if it is not,
+ * -1 if memory can not be allocated.
+ */
+static int expr_cse_scan(struct expr_cse *c, struct expr *e,
+                         unsigned int *hash) {
+  unsigned int key[4] = {0, 0, 0, 0};
+  int i, h, pure = 1, first = vec_len(&c->entries), cls[2] = {-1, -2};
+  vec_expr_t *args = &e->param.op.args;
+  struct expr_cse_entry entry;
+  key[0] = (unsigned int)e->type;
+  switch (e->type) {
+  case OP_CONST:
+    memcpy(&key[1], &e->param.num.value, sizeof(expr_num_t));
+    *hash = expr_hash((const char *)key, sizeof(key));
+    return 1;
+  case OP_VAR:
+    memcpy(&key[1], &e->param.var.value, sizeof(expr_num_t *));
+    *hash = expr_hash((const char *)key, sizeof(key));
+    return !expr_is_assigned(&c->assigned, e->param.var.value);
+  case OP_UNKNOWN:
+    *hash = expr_hash((const char *)key, sizeof(key));
+    return 1;
+  case OP_FUNC:
+    memcpy(&key[1], &e->param.func.f, sizeof(struct expr_func *));
+    args = &e->param.func.args;
+    pure = e->param.func.f->pure;
+    break;
+  case OP_ASSIGN:
+    pure = 0;
+    break;
+  default:
+    break;
+  }
+  for (i = 0; i < vec_len(args); i++) {
+    int before = vec_len(&c->entries);
+    h = expr_cse_scan(c, &vec_nth(args, i), &key[3]);
+    if (h == -1) {
+      return -1;
+    } else if (h == 1 && i < 2 && vec_len(&c->entries) > before &&
+               vec_peek(&c->entries).e == &vec_nth(args, i)) {
+      cls[i] = vec_peek(&c->entries).cls;
+    }
+    pure = pure && h;
+    key[3] = expr_hash((const char *)&key[2], 2 * sizeof(unsigned int));
+    key[2] = key[3];
+  }
+  *hash = expr_hash((const char *)key, sizeof(key));
+  if (!pure) {
+    /* Entries of the pure arguments stay, but no range covers them */
+    return 0;
+  }
+  if (e->type == OP_MULTIPLY && cls[0] == cls[1] && cls[0] != -1) {
+    vec_nth(&c->classes, cls[0]).square = 1;
+  }
+  entry.e = e;
+  entry.cls = -1;
+  entry.size = vec_len(&c->entries) - first + 1;
+  entry.state = EXPR_CSE_ALIVE;
+  /* Integer subtrees would lose precision in a variable */
+  if (EXPR_INT64 || !expr_is_int(e->type)) {
+    entry.cls = expr_cse_class(c, e, *hash);
+    if (entry.cls == -1) {
+      return -1;
+    }
+  }
+  return (vec_push(&c->entries, entry) == -1 ? -1 : 1);
+}
+
+/* Returns 1 if the subtree could be shared, see expr_cse_scan() */
+static int expr_cse_pure(struct expr_cse *c, struct expr *e) {
+  vec_expr_t *args = &e->param.op.args;
+  if (e->type == OP_VAR) {
+    return !expr_is_assigned(&c->assigned, e->param.var.value);
+  } else if (e->type == OP_CONST || e->type == OP_UNKNOWN) {
+    return 1;
+  } else if (e->type == OP_ASSIGN ||
+             (e->type == OP_FUNC && !e->param.func.f->pure)) {
+    return 0;
+  } else if (e->type == OP_FUNC) {
+    args = &e->param.func.args;
+  }
+  for (int i = 0; i < vec_len(args); i++) {
+    if (!expr_cse_pure(c, &vec_nth(args, i))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Copies a pure subtree, returns -1 if memory can not be allocated */
+static int expr_cse_copy(struct expr *to, struct expr *from) {
+  vec_expr_t *args = &from->param.op.args, *copy = &to->param.op.args;
+  int i;
+  *to = *from;
+#if JIT
+  to->fn = NULL;
+  to->batchfn = NULL;
+#endif
+  if (from->type == OP_CONST || from->type == OP_VAR ||
+      from->type == OP_UNKNOWN) {
+    return 0;
+  } else if (from->type == OP_FUNC) {
+    struct expr_func *f = from->param.func.f;
+    args = &from->param.func.args;
+    copy = &to->param.func.args;
+    to->param.func.context = NULL;
+    if (f->ctxsz > 0 &&
+        (to->param.func.context = expr_alloc_context(NULL, f)) == NULL) {
+      return -1;
+    }
+    if (f->f == expr_macro_call) {
+      ((struct expr_macro *)f)->refs++;
+    }
+  }
+  if (expr_alloc_args(NULL, copy, vec_len(args)) == -1) {
+    expr_destroy_args(to);
+    return -1;
+  }
+  for (i = 0; i < vec_len(args); i++) {
+    if (expr_cse_copy(&vec_nth(copy, i), &vec_nth(args, i)) == -1) {
+      copy->len = i; /* the rest is not initialized */
+      expr_destroy_args(to);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Turns squares of shareable subtrees into products of two copies, which are
+ * then shared like any other occurrences: E**2 becomes $#n*$#n. Returns -1 if
+ * memory can not be allocated, squares turned so far are listed.
+ */
+static int expr_cse_squares(struct expr_cse *c, struct expr *e,
+                            vec_expr_ptr_t *squares) {
+  vec_expr_t *args = &e->param.op.args;
+  if (e->type == OP_CONST || e->type == OP_VAR || e->type == OP_UNKNOWN) {
+    return 0;
+  } else if (e->type == OP_FUNC) {
+    args = &e->param.func.args;
+  } else if (e->type == OP_POWER && expr_is_const(&vec_nth(args, 1), 2) &&
+             (expr_is_unary(vec_nth(args, 0).type) ||
+              expr_is_binary(vec_nth(args, 0).type) ||
+              vec_nth(args, 0).type == OP_FUNC) &&
+             (EXPR_INT64 || !expr_is_int(vec_nth(args, 0).type)) &&
+             expr_cse_pure(c, &vec_nth(args, 0))) {
+    if (vec_push(squares, e) == -1 ||
+        expr_cse_copy(&vec_nth(args, 1), &vec_nth(args, 0)) == -1) {
+      vec_nth(args, 1) = expr_const(2);
+      return -1;
+    }
+    e->type = OP_MULTIPLY;
+  }
+  for (int i = 0; i < vec_len(args); i++) {
+    if (expr_cse_squares(c, &vec_nth(args, i), squares) == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Marks occurrences that are moved or replaced. Larger subtrees are decided
+ * first, so occurrences inside replaced ones are no longer counted when their
+ * own class is decided. Returns number of shared classes or -1.
+ */
+static int expr_cse_decide(struct expr_cse *c) {
+  int i, j, k, n = vec_len(&c->entries), shared = 0;
+  int *order = (int *)malloc((n + 1) * sizeof(int));
+  int *pos = (int *)calloc(n + 2, sizeof(int));
+  if (order == NULL || pos == NULL) {
+    free(order);
+    free(pos);
+    return -1;
+  }
+  /* Counting sort by size, outer occurrences first within a size */
+  for (i = 0; i < n; i++) {
+    pos[vec_nth(&c->entries, i).size]++;
+  }
+  for (k = n, j = 0; k > 0; k--) {
+    int count = pos[k];
+    pos[k] = j;
+    j += count;
+  }
+  for (i = n - 1; i >= 0; i--) {
+    order[pos[vec_nth(&c->entries, i).size]++] = i;
+  }
+  for (j = 0; j < n; j++) {
+    struct expr_cse_entry *entry = &vec_nth(&c->entries, order[j]);
+    struct expr_cse_class *cls;
+    if (entry->state != EXPR_CSE_ALIVE || entry->cls == -1) {
+      continue;
+    }
+    cls = &vec_nth(&c->classes, entry->cls);
+    if (!cls->seen) {
+      /* Sharing must save more operators than the variable costs */
+      cls->seen = 1;
+      if ((cls->count - 1) * entry->size > 1 ||
+          (cls->square && cls->count > 1)) {
+        cls->def = order[j];
+        entry->state = EXPR_CSE_DEF;
+        shared++;
+      }
+    } else if (cls->def != -1) {
+      entry->state = EXPR_CSE_REPLACED;
+      for (k = order[j] - entry->size + 1; k < order[j]; k++) {
+        struct expr_cse_entry *inner = &vec_nth(&c->entries, k);
+        if (inner->state != EXPR_CSE_DEAD && inner->cls != -1) {
+          vec_nth(&c->classes, inner->cls).count--;
+        }
+        inner->state = EXPR_CSE_DEAD;
+      }
+    }
+  }
+  free(order);
+  free(pos);
+  return shared;
+}
+
+/*
+ * Shares structurally equal subtrees that have no side effects and don't read
+ * variables assigned anywhere in the expression. Function calls are shared
+ * only if the function is pure. Shared values are computed once per
+ * evaluation into hidden variables "$#0", "$#1", ... of the list, which are
+ * reserved and must not be used by expressions, like the "$@" temporaries of
+ * expr_unchain(). Squares of such subtrees are
+ * multiplications of the variable by itself. Returns number of shared
+ * subtrees or -1 if memory can not be allocated or the expression belongs to
+ * an arena, in which case the expression is not modified.
+ */
+static int expr_cse(struct expr *e, struct expr_var_list *vars) {
+  struct expr_cse c;
+  vec(struct expr_cse_entry) defs = vec_init();
+  vec_expr_ptr_t squares = vec_init();
+  vec_expr_t *prelude = NULL;
+  struct expr x = expr_init();
+  unsigned int hash;
+  int i, k, n = 0, shared = -1;
+  char name[16];
+
+  memset(&c, 0, sizeof(c));
+  if (expr_is_unary(e->type) || expr_is_binary(e->type)) {
+    if (expr_arena_owned(&e->param.op.args)) {
+      return -1; /* arena expressions can't grow */
+    }
+  } else if (e->type != OP_FUNC) {
+    return 0;
+  }
+  for (c.nbuckets = 16; c.nbuckets < expr_count(e); c.nbuckets *= 2)
+    ;
+  c.buckets = (int *)malloc(c.nbuckets * sizeof(int));
+  if (c.buckets == NULL || expr_assigned(&c.assigned, e) == -1 ||
+      expr_cse_squares(&c, e, &squares) == -1) {
+    goto cleanup;
+  }
+  for (i = 0; i < c.nbuckets; i++) {
+    c.buckets[i] = -1;
+  }
+  if (expr_cse_scan(&c, e, &hash) == -1) {
+    goto cleanup;
+  }
+  n = expr_cse_decide(&c);
+  if (n <= 0) {
+    shared = n;
+    n = 0;
+    goto cleanup;
+  }
+
+  /* Everything that can fail is done before the tree is modified */
+  for (i = 0; i < vec_len(&c.entries); i++) {
+    if (vec_nth(&c.entries, i).state == EXPR_CSE_DEF &&
+        vec_push(&defs, vec_nth(&c.entries, i)) == -1) {
+      goto cleanup;
+    }
+  }
+  /* Inner shared subtrees are computed first */
+  for (i = 1; i < n; i++) {
+    struct expr_cse_entry def = vec_nth(&defs, i);
+    for (k = i; k > 0 && vec_nth(&defs, k - 1).size > def.size; k--) {
+      vec_nth(&defs, k) = vec_nth(&defs, k - 1);
+    }
+    vec_nth(&defs, k) = def;
+  }
+  for (i = 0; i < n; i++) {
+    struct expr_cse_class *cls = &vec_nth(&c.classes, vec_nth(&defs, i).cls);
+    snprintf(name, sizeof(name), "$#%d", i);
+    cls->var = expr_var(vars, name, strlen(name));
+    if (cls->var == NULL) {
+      goto cleanup;
+    }
+  }
+  /* Every shared subtree needs an assignment and a comma */
+  prelude = (vec_expr_t *)calloc(2 * n, sizeof(vec_expr_t));
+  if (prelude == NULL) {
+    goto cleanup;
+  }
+  for (i = 0; i < 2 * n; i++) {
+    if (expr_alloc_args(NULL, &prelude[i], 2) == -1) {
+      goto cleanup;
+    }
+  }
+
+#if JIT
+  expr_jit_release(e);
+#endif
+  for (i = vec_len(&c.entries) - 1; i >= 0; i--) {
+    struct expr_cse_entry *entry = &vec_nth(&c.entries, i);
+    if (entry->state == EXPR_CSE_DEF) {
+      for (k = 0; vec_nth(&defs, k).e != entry->e; k++)
+        ;
+      vec_nth(&prelude[2 * k], 1) = *entry->e;
+    } else if (entry->state == EXPR_CSE_REPLACED) {
+      expr_destroy_args(entry->e);
+    } else {
+      continue;
+    }
+    *entry->e = expr_varref(vec_nth(&c.classes, entry->cls).var);
+  }
+  /* $#0 = ..., $#1 = ..., expression */
+  for (k = 0; k < n; k++) {
+    struct expr assign = expr_init();
+    assign.type = OP_ASSIGN;
+    assign.param.op.args = prelude[2 * k];
+    vec_nth(&assign.param.op.args, 0) =
+        expr_varref(vec_nth(&c.classes, vec_nth(&defs, k).cls).var);
+    if (k == 0) {
+      x = assign;
+    } else {
+      vec_nth(&prelude[2 * k - 1], 0) = x;
+      vec_nth(&prelude[2 * k - 1], 1) = assign;
+      x.type = OP_COMMA;
+      x.param.op.args = prelude[2 * k - 1];
+    }
+  }
+  vec_nth(&prelude[2 * n - 1], 0) = x;
+  vec_nth(&prelude[2 * n - 1], 1) = *e;
+  x.type = OP_COMMA;
+  x.param.op.args = prelude[2 * n - 1];
+  *e = x;
+  shared = n;
+#if JIT
+  e->fn = expr_compile(e, &e->jitsz);
+  e->batchfn = expr_compile_batch(e, &e->batchsz);
+#endif
+cleanup:
+  if (shared == -1 && prelude != NULL) {
+    for (i = 0; i < 2 * n; i++) {
+      vec_free(&prelude[i]);
+    }
+  }
+  for (i = 0; shared == -1 && i < vec_len(&squares); i++) {
+    struct expr *square = vec_nth(&squares, i);
+    if (square->type == OP_MULTIPLY) {
+      expr_destroy_args(&vec_nth(&square->param.op.args, 1));
+      vec_nth(&square->param.op.args, 1) = expr_const(2);
+      square->type = OP_POWER;
+    }
+  }
+  free(prelude);
+  free(c.buckets);
+  vec_free(&c.classes);
+  vec_free(&c.entries);
+  vec_free(&c.assigned);
+  vec_free(&defs);
+  vec_free(&squares);
+  return shared;
+}
+
+/*
+ * Bytecode: expression tree lowered into a flat postfix program
+ */
+
+/* Bytecode-only instructions, numbered after the expression node types */
+enum {
+  OP_POP = OP_FUNC + 1, /* drop top of the stack */
+  OP_STORE,             /* store top of the stack into a variable */
+  OP_JZ,                /* &&: if top is zero - jump, otherwise pop */
+  OP_JNZ,               /* ||: if top is non-zero and not NaN - jump */
+  OP_NONZERO,           /* turn negative zero into zero */
+  OP_ICONST,            /* push integer constant */
+  OP_INT,               /* move top of the stack to the integer stack */
+  OP_NUM,               /* move top of the integer stack back */
+};
+
+#define EXPR_CODE_STACK 64
+
+struct expr_insn {
+  int op;
+  union {
+    expr_num_t num;
+    expr_int_t inum;
+    expr_num_t *var;
+    struct expr *func;
+    int jump;
+  } param;
+};
+
+typedef vec(struct expr_insn) vec_insn_t;
+
+struct expr_code {
+  vec_insn_t insns;
+  int depth;
+};
+
+static int expr_code_emit(struct expr_code *c, struct expr_insn insn,
+                          int *depth, int delta) {
+  *depth = *depth + delta;
+  if (*depth > c->depth) {
+    c->depth = *depth;
+  }
+  return vec_push(&c->insns, insn);
+}
+
+static int expr_code_compile(struct expr_code *c, struct expr *e, int *depth);
+
+/*
+ * Integer subtree, see expr_eval_int(). Its values are kept on a separate
+ * integer stack, depth counts the values of both stacks.
+ */
+static int expr_code_compile_int(struct expr_code *c, struct expr *e,
+                                 int *depth) {
+  struct expr_insn insn = {0, {0}};
+  int i;
+  if (e->type == OP_CONST) {
+    insn.op = OP_ICONST;
+    insn.param.inum = to_int(e->param.num.value);
+    return expr_code_emit(c, insn, depth, 1);
+  } else if (!expr_is_int(e->type)) {
+    insn.op = OP_INT;
+    if (expr_code_compile(c, e, depth) == -1) {
+      return -1;
+    }
+    return expr_code_emit(c, insn, depth, 0);
+  }
+  for (i = 0; i < vec_len(&e->param.op.args); i++) {
+    if (expr_code_compile_int(c, &vec_nth(&e->param.op.args, i), depth) ==
+        -1) {
+      return -1;
+    }
+  }
+  insn.op = e->type;
+  return expr_code_emit(c, insn, depth, 1 - i);
+}
+
+static int expr_code_compile(struct expr_code *c, struct expr *e, int *depth) {
+  struct expr_insn insn = {0, {0}};
+  int jump;
+  if (expr_is_int(e->type)) {
+    if (expr_code_compile_int(c, e, depth) == -1) {
+      return -1;
+    }
+    insn.op = OP_NUM;
+    return expr_code_emit(c, insn, depth, 0);
+  }
+  switch (e->type) {
+  case OP_UNARY_MINUS:
+  case OP_UNARY_LOGICAL_NOT:
+    if (expr_code_compile(c, &e->param.op.args.buf[0], depth) == -1) {
+      return -1;
+    }
+    insn.op = e->type;
+    return expr_code_emit(c, insn, depth, 0);
+  case OP_LOGICAL_AND:
+  case OP_LOGICAL_OR:
+    if (expr_code_compile(c, &e->param.op.args.buf[0], depth) == -1) {
+      return -1;
+    }
+    jump = vec_len(&c->insns);
+    insn.op = (e->type == OP_LOGICAL_AND ? OP_JZ : OP_JNZ);
+    if (expr_code_emit(c, insn, depth, -1) == -1 ||
+        expr_code_compile(c, &e->param.op.args.buf[1], depth) == -1) {
+      return -1;
+    }
+    insn.op = OP_NONZERO;
+    if (expr_code_emit(c, insn, depth, 0) == -1) {
+      return -1;
+    }
+    vec_nth(&c->insns, jump).param.jump = vec_len(&c->insns);
+    return 0;
+  case OP_ASSIGN:
+    if (expr_code_compile(c, &e->param.op.args.buf[1], depth) == -1) {
+      return -1;
+    }
+    if (vec_nth(&e->param.op.args, 0).type != OP_VAR) {
+      return 0;
+    }
+    insn.op = OP_STORE;
+    insn.param.var = e->param.op.args.buf[0].param.var.value;
+    return expr_code_emit(c, insn, depth, 0);
+  case OP_COMMA:
+    if (expr_code_compile(c, &e->param.op.args.buf[0], depth) == -1) {
+      return -1;
+    }
+    insn.op = OP_POP;
+    if (expr_code_emit(c, insn, depth, -1) == -1) {
+      return -1;
+    }
+    return expr_code_compile(c, &e->param.op.args.buf[1], depth);
+  case OP_CONST:
+    insn.op = OP_CONST;
+    insn.param.num = e->param.num.value;
+    return expr_code_emit(c, insn, depth, 1);
+  case OP_VAR:
+    insn.op = OP_VAR;
+    insn.param.var = e->param.var.value;
+    return expr_code_emit(c, insn, depth, 1);
+  case OP_FUNC:
+    /* Function arguments are evaluated by the callback from the tree */
+    insn.op = OP_FUNC;
+    insn.param.func = e;
+    return expr_code_emit(c, insn, depth, 1);
+  default:
+    if (!expr_is_binary(e->type)) {
+      insn.op = OP_CONST;
+      insn.param.num = EXPR_NAN;
+      return expr_code_emit(c, insn, depth, 1);
+    }
+    if (expr_code_compile(c, &e->param.op.args.buf[0], depth) == -1 ||
+        expr_code_compile(c, &e->param.op.args.buf[1], depth) == -1) {
+      return -1;
+    }
+    insn.op = e->type;
+    return expr_code_emit(c, insn, depth, -1);
+  }
+}
+
+static struct expr_code *expr_code_create(struct expr *e) {
+  int depth = 0;
+  struct expr_code *c = (struct expr_code *)calloc(1, sizeof(*c));
+  if (c == NULL) {
+    return NULL; /* allocation failed */
+  }
+  if (expr_code_compile(c, e, &depth) == -1) {
+    vec_free(&c->insns);
+    free(c);
+    return NULL;
+  }
+  return c;
+}
+
+static expr_num_t expr_code_eval(struct expr_code *c) {
+  expr_num_t local[EXPR_CODE_STACK];
+  expr_int_t ilocal[EXPR_CODE_STACK];
+  expr_num_t *stack = local;
+  expr_int_t *istack = ilocal;
+  expr_num_t *sp;
+  expr_int_t *isp;
+  expr_num_t top = 0;
+  expr_int_t itop = 0;
+  struct expr *f;
+  struct expr_insn *start = c->insns.buf;
+  struct expr_insn *end = start + vec_len(&c->insns);
+  if (c->depth > EXPR_CODE_STACK) {
+    stack = (expr_num_t *)malloc(c->depth *
+                                 (sizeof(expr_num_t) + sizeof(expr_int_t)));
+    if (stack == NULL) {
+      return EXPR_NAN; /* allocation failed */
+    }
+    istack = (expr_int_t *)(stack + c->depth);
+  }
+  sp = stack;
+  isp = istack;
+  for (struct expr_insn *pc = start; pc < end; pc++) {
+    switch (pc->op) {
+    case OP_UNARY_MINUS:
+      top = expr_neg(top);
+      break;
+    case OP_UNARY_LOGICAL_NOT:
+      top = !top;
+      break;
+    case OP_UNARY_BITWISE_NOT:
+      itop = ~itop;
+      break;
+    case OP_POWER:
+      top = expr_pow(*--sp, top);
+      break;
+    case OP_MULTIPLY:
+      top = expr_mul(*--sp, top);
+      break;
+    case OP_DIVIDE:
+      top = expr_div(*--sp, top);
+      break;
+    case OP_REMAINDER:
+      top = expr_fmod(*--sp, top);
+      break;
+    case OP_PLUS:
+      top = expr_add(*--sp, top);
+      break;
+    case OP_MINUS:
+      top = expr_sub(*--sp, top);
+      break;
+    case OP_SHL:
+      itop = expr_shl(*--isp, itop);
+      break;
+    case OP_SHR:
+      itop = expr_shr(*--isp, itop);
+      break;
+    case OP_LT:
+      top = *--sp < top;
+      break;
+    case OP_LE:
+      top = *--sp <= top;
+      break;
+    case OP_GT:
+      top = *--sp > top;
+      break;
+    case OP_GE:
+      top = *--sp >= top;
+      break;
+    case OP_EQ:
+      top = *--sp == top;
+      break;
+    case OP_NE:
+      top = *--sp != top;
+      break;
+    case OP_BITWISE_AND:
+      itop = *--isp & itop;
+      break;
+    case OP_BITWISE_OR:
+      itop = *--isp | itop;
+      break;
+    case OP_BITWISE_XOR:
+      itop = *--isp ^ itop;
+      break;
+    case OP_CONST:
+      *sp++ = top;
+      top = pc->param.num;
+      break;
+    case OP_VAR:
+      *sp++ = top;
+      top = *pc->param.var;
+      break;
+    case OP_FUNC:
+      f = pc->param.func;
+      *sp++ = top;
+      top = f->param.func.f->f(f->param.func.f, &f->param.func.args,
+                               f->param.func.context);
+      break;
+    case OP_POP:
+      top = *--sp;
+      break;
+    case OP_STORE:
+      *pc->param.var = top;
+      break;
+    case OP_JZ:
+      if (top == 0) {
+        top = 0;
+        pc = start + pc->param.jump - 1;
+      } else {
+        top = *--sp;
+      }
+      break;
+    case OP_JNZ:
+      if (top != 0 && !expr_isnan(top)) {
+        pc = start + pc->param.jump - 1;
+      } else {
+        top = *--sp;
+      }
+      break;
+    case OP_NONZERO:
+      if (top == 0) {
+        top = 0;
+      }
+      break;
+    case OP_ICONST:
+      *isp++ = itop;
+      itop = pc->param.inum;
+      break;
+    case OP_INT:
+      *isp++ = itop;
+      itop = to_int(top);
+      top = *--sp;
+      break;
+    case OP_NUM:
+      *sp++ = top;
+      top = itop;
+      itop = *--isp;
+      break;
+    default:
+      top = EXPR_NAN;
+      break;
+    }
+  }
+  if (stack != local) {
+    free(stack);
+  }
+  return top;
+}
+
+static void expr_code_destroy(struct expr_code *c) {
+  if (c != NULL) {
+    vec_free(&c->insns);
+    free(c);
+  }
+}
+
+/*
+ * Eager calls: arguments are computed beforehand and the function gets them as
+ * constants, so it doesn't read variables and can be called from frames and
+ * batches. Only for functions that are pure or thread-safe, with arguments
+ * that have nothing to skip: no assignments and no calls of impure functions.
+ */
+#ifndef EXPR_CALL_ARGS
+#define EXPR_CALL_ARGS 16
+#endif
+
+static int expr_is_eager(struct expr *e);
+
+static int expr_is_eager_arg(struct expr *e) {
+  if (e->type == OP_ASSIGN) {
+    return 0;
+  } else if (e->type == OP_FUNC) {
+    return e->param.func.f->pure && expr_is_eager(e);
+  } else if (e->type == OP_CONST || e->type == OP_VAR ||
+             e->type == OP_UNKNOWN) {
+    return 1;
+  }
+  for (int i = 0; i < vec_len(&e->param.op.args); i++) {
+    if (!expr_is_eager_arg(&vec_nth(&e->param.op.args, i))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int expr_is_eager(struct expr *e) {
+  struct expr_func *f = e->param.func.f;
+  vec_expr_t *args = &e->param.func.args;
+  if (f->f == expr_macro_call || !(f->pure || f->threadsafe) ||
+      vec_len(args) > EXPR_CALL_ARGS) {
+    return 0;
+  }
+  for (int i = 0; i < vec_len(args); i++) {
+    if (!expr_is_eager_arg(&vec_nth(args, i))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Calls the function with the given argument values */
+static expr_num_t expr_call_eager(struct expr *e, const expr_num_t *values) {
+  struct expr args[EXPR_CALL_ARGS];
+  vec_expr_t v;
+  v.buf = args;
+  v.len = v.cap = vec_len(&e->param.func.args);
+  for (int i = 0; i < v.len; i++) {
+    args[i] = expr_const(values[i]);
+  }
+  return e->param.func.f->f(e->param.func.f, &v, e->param.func.context);
+}
+
+/*
+ * Slots of variables by the address of their value: open addressing over an
+ * array of variable pointers, kept at most half full, so that forms with many
+ * variables are compiled in linear time. NULL entries are not indexed.
+ */
+struct expr_slot_index {
+  int *slots; /* slot + 1, 0 for free entries */
+  int size;   /* power of two, 0 until the first slot is added */
+};
+
+static unsigned int expr_slot_hash(expr_num_t *value) {
+  size_t x = (size_t)value / sizeof(expr_num_t);
+  return (unsigned int)(x ^ (x >> 16)) * 2654435761u;
+}
+
+/* Returns slot of the variable with the given value address, or -1 */
+static int expr_slot_find(struct expr_slot_index *t, expr_num_t **vars,
+                          expr_num_t *value) {
+  unsigned int i, mask = (unsigned int)t->size - 1;
+  if (t->size == 0) {
+    return -1;
+  }
+  for (i = expr_slot_hash(value) & mask; t->slots[i] != 0; i = (i + 1) & mask) {
+    if (vars[t->slots[i] - 1] == value) {
+      return t->slots[i] - 1;
+    }
+  }
+  return -1;
+}
+
+/* Indexes slot n of vars, all slots are reinserted when the table grows */
+static int expr_slot_add(struct expr_slot_index *t, expr_num_t **vars, int n) {
+  unsigned int i, mask;
+  int k = n;
+  if ((n + 1) * 2 > t->size) {
+    int size = (t->size == 0 ? 16 : t->size * 2);
+    int *slots = (int *)calloc(size, sizeof(int));
+    if (slots == NULL) {
+      return -1;
+    }
+    free(t->slots);
+    t->slots = slots;
+    t->size = size;
+    k = 0;
+  }
+  mask = (unsigned int)t->size - 1;
+  for (; k <= n; k++) {
+    if (vars[k] != NULL) {
+      for (i = expr_slot_hash(vars[k]) & mask; t->slots[i] != 0;
+           i = (i + 1) & mask) {
+      }
+      t->slots[i] = k + 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Flat form: expression tree stored as an array of 8-byte nodes in postfix
+ * order. The last argument of a node is the node right before it, the first
+ * argument of a binary node is referenced by its distance back from the node.
+ * Constants, variables and functions are kept in side pools. Macro calls are
+ * inlined: arguments are assigned to slots of their own, read by the body.
+ * Arguments of eager calls are compiled before the call node.
+ */
+#define EXPR_FLAT_INLINE 65536 /* nodes, larger forms call macros instead */
+
+struct expr_node {
+  unsigned int type; /* enum expr_type */
+  unsigned int arg;  /* distance to first argument or index in the pool */
+};
+
+struct expr_flat_func {
+  struct expr *e; /* function call in the tree */
+  int args;       /* first argument root in the pool, -1 if not eager */
+};
+
+struct expr_flat {
+  vec(struct expr_node) nodes;
+  vec(expr_num_t) consts;
+  vec(expr_num_t *) vars; /* variable of each slot */
+  vec(struct expr_flat_func) funcs;
+  vec(int) args;      /* root nodes of the eager call arguments */
+  expr_num_t *params; /* variables of the inlined macro parameters */
+  struct expr_slot_index index; /* slots of the variables */
+};
+
+/* Inlined macro call, parameter $k+1 of the body is in slot params[k] */
+struct expr_flat_call {
+  struct expr_macro *m;
+  int *params;
+};
+
+static int expr_flat_push(struct expr_flat *f, enum expr_type type,
+                          unsigned int arg) {
+  struct expr_node node;
+  node.type = (unsigned int)type;
+  node.arg = arg;
+  if (vec_push(&f->nodes, node) == -1) {
+    return -1;
+  }
+  return vec_len(&f->nodes) - 1;
+}
+
+/* Returns slot of the variable with the given value address, or -1 */
+static int expr_flat_slot(struct expr_flat *f, expr_num_t *value) {
+  return expr_slot_find(&f->index, f->vars.buf, value);
+}
+
+static int expr_flat_compile(struct expr_flat *f, struct expr *e,
+                             struct expr_flat_call *call);
+
+static int expr_flat_const(struct expr_flat *f, expr_num_t value) {
+  if (vec_push(&f->consts, value) == -1) {
+    return -1;
+  }
+  return expr_flat_push(f, OP_CONST, vec_len(&f->consts) - 1);
+}
+
+/*
+ * Appends a macro call as "$1 = arg1, $2 = arg2, ..., body" with parameters
+ * in new slots, so calls are independent of each other and of the macro
+ * variables. Returns index of the last node or -1.
+ */
+static int expr_flat_inline(struct expr_flat *f, struct expr *e,
+                            struct expr_flat_call *outer) {
+  struct expr_macro *m = (struct expr_macro *)e->param.func.f;
+  vec_expr_t *args = &e->param.func.args;
+  int params[EXPR_MACRO_PARAMS];
+  struct expr_flat_call call;
+  int i, a, first = -1;
+  int n = (vec_len(args) > m->nparams ? vec_len(args) : m->nparams);
+  call.m = m;
+  call.params = params;
+  for (i = 0; i < n; i++) {
+    int used = (i < m->nparams && m->slots[i] != NULL);
+    if (!used && i >= vec_len(args)) {
+      continue;
+    }
+    if (used) {
+      params[i] = vec_len(&f->vars);
+      if (vec_push(&f->vars, NULL) == -1 ||
+          (a = expr_flat_push(f, OP_VAR, params[i])) == -1) {
+        return -1;
+      }
+    }
+    /* Extra arguments are still evaluated, missing ones are zero */
+    if ((i < vec_len(args)
+             ? expr_flat_compile(f, &vec_nth(args, i), outer)
+             : expr_flat_const(f, 0)) == -1 ||
+        (used && expr_flat_push(f, OP_ASSIGN, vec_len(&f->nodes) - a) == -1) ||
+        (first != -1 &&
+         expr_flat_push(f, OP_COMMA, vec_len(&f->nodes) - first) == -1)) {
+      return -1;
+    }
+    first = vec_len(&f->nodes) - 1;
+  }
+  if (expr_flat_compile(f, &m->body, &call) == -1) {
+    return -1;
+  }
+  if (first != -1) {
+    return expr_flat_push(f, OP_COMMA, vec_len(&f->nodes) - first);
+  }
+  return vec_len(&f->nodes) - 1;
+}
+
+/* Appends a function call, arguments first if it is eager */
+static int expr_flat_apply(struct expr_flat *f, struct expr *e,
+                           struct expr_flat_call *call) {
+  vec_expr_t *args = &e->param.func.args;
+  struct expr_flat_func fn;
+  int i, roots[EXPR_CALL_ARGS];
+  fn.e = e;
+  fn.args = -1;
+  if (expr_is_eager(e)) {
+    for (i = 0; i < vec_len(args); i++) {
+      if ((roots[i] = expr_flat_compile(f, &vec_nth(args, i), call)) == -1) {
+        return -1;
+      }
+    }
+    fn.args = vec_len(&f->args);
+    for (i = 0; i < vec_len(args); i++) {
+      if (vec_push(&f->args, roots[i]) == -1) {
+        return -1;
+      }
+    }
+  }
+  if (vec_push(&f->funcs, fn) == -1) {
+    return -1;
+  }
+  return expr_flat_push(f, e->type, vec_len(&f->funcs) - 1);
+}
+
+/* Appends the subtree, returns index of its root node or -1 */
+static int expr_flat_compile(struct expr_flat *f, struct expr *e,
+                             struct expr_flat_call *call) {
+  int a;
+  switch (e->type) {
+  case OP_CONST:
+    return expr_flat_const(f, e->param.num.value);
+  case OP_VAR:
+    if (call != NULL) {
+      a = expr_macro_param(expr_var_of(e->param.var.value)->name);
+      if (a != -1 && a < call->m->nparams &&
+          call->m->slots[a] == e->param.var.value) {
+        return expr_flat_push(f, e->type, call->params[a]);
+      }
+    }
+    a = expr_flat_slot(f, e->param.var.value);
+    if (a == -1) {
+      if (vec_push(&f->vars, e->param.var.value) == -1) {
+        return -1;
+      }
+      a = vec_len(&f->vars) - 1;
+      if (expr_slot_add(&f->index, f->vars.buf, a) == -1) {
+        return -1;
+      }
+    }
+    return expr_flat_push(f, e->type, a);
+  case OP_FUNC:
+    if (e->param.func.f->f == expr_macro_call &&
+        vec_len(&f->nodes) < EXPR_FLAT_INLINE) {
+      return expr_flat_inline(f, e, call);
+    }
+    return expr_flat_apply(f, e, call);
+  case OP_UNKNOWN:
+    return expr_flat_push(f, e->type, 0);
+  default:
+    if (expr_is_unary(e->type)) {
+      if (expr_flat_compile(f, &e->param.op.args.buf[0], call) == -1) {
+        return -1;
+      }
+      return expr_flat_push(f, e->type, 0);
+    }
+    a = expr_flat_compile(f, &e->param.op.args.buf[0], call);
+    if (a == -1 ||
+        expr_flat_compile(f, &e->param.op.args.buf[1], call) == -1) {
+      return -1;
+    }
+    return expr_flat_push(f, e->type, vec_len(&f->nodes) - a);
+  }
+}
+
+static void expr_flat_destroy(struct expr_flat *f);
+
+EXPR_UNUSED
+static struct expr_flat *expr_flat_create(struct expr *e) {
+  struct expr_flat *f = (struct expr_flat *)calloc(1, sizeof(*f));
+  int i, n = 0;
+  if (f == NULL) {
+    return NULL; /* allocation failed */
+  }
+  if (expr_flat_compile(f, e, NULL) == -1) {
+    expr_flat_destroy(f);
+    return NULL;
+  }
+  /* Parameter slots get their variables once the number is known */
+  f->params = (expr_num_t *)calloc(vec_len(&f->vars) + 1, sizeof(expr_num_t));
+  if (f->params == NULL) {
+    expr_flat_destroy(f);
+    return NULL;
+  }
+  for (i = 0; i < vec_len(&f->vars); i++) {
+    if (vec_nth(&f->vars, i) == NULL) {
+      vec_nth(&f->vars, i) = &f->params[n++];
+    }
+  }
+  return f;
+}
+
+static expr_num_t expr_flat_eval_node(struct expr_flat *f, struct expr_node *n,
+                                      expr_num_t *slots);
+
+/* Eager call, kept out of expr_flat_eval_node() to keep its frame small */
+static expr_num_t expr_flat_eval_call(struct expr_flat *f,
+                                      struct expr_flat_func *fn,
+                                      expr_num_t *slots) {
+  expr_num_t values[EXPR_CALL_ARGS];
+  int *roots = f->args.buf + fn->args;
+  for (int i = 0; i < vec_len(&fn->e->param.func.args); i++) {
+    values[i] = expr_flat_eval_node(f, &f->nodes.buf[roots[i]], slots);
+  }
+  return expr_call_eager(fn->e, values);
+}
+
+/* Integer subtree, see expr_eval_int() */
+static expr_int_t expr_flat_eval_int(struct expr_flat *f, struct expr_node *n,
+                                     expr_num_t *slots) {
+  expr_int_t a;
+#define EXPR_FLAT_A expr_flat_eval_int(f, n - n->arg, slots)
+#define EXPR_FLAT_B expr_flat_eval_int(f, n - 1, slots)
+  switch (n->type) {
+  case OP_UNARY_BITWISE_NOT:
+    return ~EXPR_FLAT_B;
+  case OP_SHL:
+    a = EXPR_FLAT_A;
+    return expr_shl(a, EXPR_FLAT_B);
+  case OP_SHR:
+    a = EXPR_FLAT_A;
+    return expr_shr(a, EXPR_FLAT_B);
+  case OP_BITWISE_AND:
+    a = EXPR_FLAT_A;
+    return a & EXPR_FLAT_B;
+  case OP_BITWISE_OR:
+    a = EXPR_FLAT_A;
+    return a | EXPR_FLAT_B;
+  case OP_BITWISE_XOR:
+    a = EXPR_FLAT_A;
+    return a ^ EXPR_FLAT_B;
+  default:
+    return to_int(expr_flat_eval_node(f, n, slots));
+  }
+#undef EXPR_FLAT_A
+#undef EXPR_FLAT_B
+}
+
+static expr_num_t expr_flat_eval_node(struct expr_flat *f, struct expr_node *n,
+                                      expr_num_t *slots) {
+  struct expr_flat_func *fn;
+  expr_num_t a;
+#define EXPR_FLAT_A expr_flat_eval_node(f, n - n->arg, slots)
+#define EXPR_FLAT_B expr_flat_eval_node(f, n - 1, slots)
+  switch (n->type) {
+  case OP_UNARY_MINUS:
+    return expr_neg(EXPR_FLAT_B);
+  case OP_UNARY_LOGICAL_NOT:
+    return !EXPR_FLAT_B;
+  case OP_POWER:
+    a = EXPR_FLAT_A;
+    return expr_pow(a, EXPR_FLAT_B);
+  case OP_MULTIPLY:
+    a = EXPR_FLAT_A;
+    return expr_mul(a, EXPR_FLAT_B);
+  case OP_DIVIDE:
+    a = EXPR_FLAT_A;
+    return expr_div(a, EXPR_FLAT_B);
+  case OP_REMAINDER:
+    a = EXPR_FLAT_A;
+    return expr_fmod(a, EXPR_FLAT_B);
+  case OP_PLUS:
+    a = EXPR_FLAT_A;
+    return expr_add(a, EXPR_FLAT_B);
+  case OP_MINUS:
+    a = EXPR_FLAT_A;
+    return expr_sub(a, EXPR_FLAT_B);
+  case OP_LT:
+    a = EXPR_FLAT_A;
+    return a < EXPR_FLAT_B;
+  case OP_LE:
+    a = EXPR_FLAT_A;
+    return a <= EXPR_FLAT_B;
+  case OP_GT:
+    a = EXPR_FLAT_A;
+    return a > EXPR_FLAT_B;
+  case OP_GE:
+    a = EXPR_FLAT_A;
+    return a >= EXPR_FLAT_B;
+  case OP_EQ:
+    a = EXPR_FLAT_A;
+    return a == EXPR_FLAT_B;
+  case OP_NE:
+    a = EXPR_FLAT_A;
+    return a != EXPR_FLAT_B;
+  case OP_UNARY_BITWISE_NOT:
+  case OP_SHL:
+  case OP_SHR:
+  case OP_BITWISE_AND:
+  case OP_BITWISE_OR:
+  case OP_BITWISE_XOR:
+    return expr_flat_eval_int(f, n, slots);
+  case OP_LOGICAL_AND:
+    if (EXPR_FLAT_A != 0) {
+      a = EXPR_FLAT_B;
+      if (a != 0) {
+        return a;
+      }
+    }
+    return 0;
+  case OP_LOGICAL_OR:
+    a = EXPR_FLAT_A;
+    if (a != 0 && !expr_isnan(a)) {
+      return a;
+    }
+    a = EXPR_FLAT_B;
+    return (a != 0 ? a : 0);
+  case OP_ASSIGN:
+    a = EXPR_FLAT_B;
+    if ((n - n->arg)->type == OP_VAR) {
+      *(slots != NULL ? &slots[(n - n->arg)->arg]
+                      : f->vars.buf[(n - n->arg)->arg]) = a;
+    }
+    return a;
+  case OP_COMMA:
+    (void)EXPR_FLAT_A;
+    return EXPR_FLAT_B;
+  case OP_CONST:
+    return f->consts.buf[n->arg];
+  case OP_VAR:
+    return (slots != NULL ? slots[n->arg] : *f->vars.buf[n->arg]);
+  case OP_FUNC:
+    fn = &f->funcs.buf[n->arg];
+    if (fn->args == -1) {
+      return fn->e->param.func.f->f(fn->e->param.func.f,
+                                    &fn->e->param.func.args,
+                                    fn->e->param.func.context);
+    }
+    return expr_flat_eval_call(f, fn, slots);
+  default:
+    return EXPR_NAN;
+  }
+#undef EXPR_FLAT_A
+#undef EXPR_FLAT_B
+}
+
+EXPR_UNUSED
+static expr_num_t expr_flat_eval(struct expr_flat *f) {
+  return expr_flat_eval_node(f, &vec_peek(&f->nodes), NULL);
+}
+
+/*
+ * Evaluates with variables taken from the frame, slots[i] is the value of the
+ * variable f->vars.buf[i]. Flat form is not modified, so one can be evaluated
+ * by many threads with their own frames, inlined macro calls included.
+ * Arguments of calls that are not eager are evaluated from the tree and use
+ * the variables themselves.
+ */
+EXPR_UNUSED
+static expr_num_t expr_flat_eval_frame(struct expr_flat *f, expr_num_t *slots) {
+  return expr_flat_eval_node(f, &vec_peek(&f->nodes), slots);
+}
+
+static void expr_flat_destroy(struct expr_flat *f) {
+  if (f != NULL) {
+    vec_free(&f->nodes);
+    vec_free(&f->consts);
+    vec_free(&f->vars);
+    vec_free(&f->funcs);
+    vec_free(&f->args);
+    free(f->params);
+    free(f->index.slots);
+    free(f);
+  }
+}
+
+/*
+ * Batch evaluation over columns of variable values
+ */
+#ifndef EXPR_BATCH_SIZE
+#define EXPR_BATCH_SIZE 256
+#endif
+
+struct expr_column {
+  struct expr_var *var;
+  const expr_num_t *data;
+  size_t len;    /* number of rows available in data */
+  size_t stride; /* distance between rows, in numbers */
+};
+
+struct expr_batch {
+  vec(expr_num_t *) vars; /* every variable the expression uses */
+  vec(expr_num_t) init;   /* variable values before the batch */
+  expr_num_t *values;     /* EXPR_BATCH_SIZE rows of every variable */
+  expr_num_t *scratch;    /* EXPR_BATCH_SIZE rows per tree level */
+  int n;             /* rows in the current block */
+  struct expr_slot_index index; /* slots of the variables */
+};
+
+static int expr_batch_var(struct expr_batch *b, expr_num_t *value) {
+  return expr_slot_find(&b->index, b->vars.buf, value);
+}
+
+static void expr_batch_free(struct expr_batch *b) {
+  vec_free(&b->vars);
+  vec_free(&b->init);
+  free(b->index.slots);
+}
+
+/* Finds the column of every slot, -1 for variables not bound to a column */
+static void expr_batch_bind(struct expr_slot_index *t, expr_num_t **vars,
+                            int nvars, struct expr_column *cols, int ncols,
+                            int *bound) {
+  int i, k;
+  for (k = 0; k < nvars; k++) {
+    bound[k] = -1;
+  }
+  for (i = 0; i < ncols; i++) {
+    k = expr_slot_find(t, vars, &cols[i].var->value);
+    if (k != -1) {
+      bound[k] = i;
+    }
+  }
+}
+
+/* Collects variables and returns the number of scratch blocks needed */
+static int expr_batch_collect(struct expr_batch *b, struct expr *e) {
+  int i, n, depth = 0;
+  vec_expr_t *args = &e->param.op.args;
+  if (e->type == OP_VAR) {
+    if (expr_batch_var(b, e->param.var.value) == -1 &&
+        (vec_push(&b->vars, e->param.var.value) == -1 ||
+         vec_push(&b->init, *e->param.var.value) == -1 ||
+         expr_slot_add(&b->index, b->vars.buf, vec_len(&b->vars) - 1))) {
+      return -1;
+    }
+    return 0;
+  } else if (e->type == OP_CONST || e->type == OP_UNKNOWN) {
+    return 0;
+  } else if (e->type == OP_FUNC) {
+    args = &e->param.func.args;
+  }
+  for (i = 0; i < vec_len(args); i++) {
+    n = expr_batch_collect(b, &vec_nth(args, i));
+    if (n == -1) {
+      return -1;
+    }
+    if (n + i > depth) {
+      depth = n + i;
+    }
+  }
+  /* Integer subtrees need a level for their result and one for converting
+     other nodes, see expr_batch_eval_int(). Arguments of eager calls are
+     kept one level up from their own scratch. */
+  if (expr_is_int(e->type)) {
+    return depth + 2;
+  }
+  return (e->type == OP_FUNC ? depth + 1 : depth);
+}
+
+/* Assignments and impure function calls can not be evaluated speculatively */
+static int expr_is_pure(struct expr *e) {
+  if (e->type == OP_ASSIGN) {
+    return 0;
+  } else if (e->type == OP_FUNC) {
+    return e->param.func.f->pure && expr_is_eager(e);
+  } else if (e->type == OP_CONST || e->type == OP_VAR ||
+             e->type == OP_UNKNOWN) {
+    return 1;
+  }
+  for (int i = 0; i < vec_len(&e->param.op.args); i++) {
+    if (!expr_is_pure(&vec_nth(&e->param.op.args, i))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Evaluates expression row by row with variables taken from the block */
+static void expr_batch_rows(struct expr_batch *b, struct expr *e,
+                            expr_num_t *out) {
+  int i, k;
+  for (i = 0; i < b->n; i++) {
+    for (k = 0; k < vec_len(&b->vars); k++) {
+      *vec_nth(&b->vars, k) = b->values[k * EXPR_BATCH_SIZE + i];
+    }
+    out[i] = expr_eval(e);
+    for (k = 0; k < vec_len(&b->vars); k++) {
+      b->values[k * EXPR_BATCH_SIZE + i] = *vec_nth(&b->vars, k);
+    }
+  }
+}
+
+static void expr_batch_eval(struct expr_batch *b, struct expr *e,
+                            expr_num_t *out, expr_num_t *tmp);
+
+/*
+ * Returns 1 if expr_batch_eval() keeps to the block and never reads or writes
+ * the variables themselves, so blocks can be evaluated by many threads.
+ */
+EXPR_UNUSED
+static int expr_batch_safe(struct expr *e) {
+  vec_expr_t *args = &e->param.op.args;
+  if (e->type == OP_CONST || e->type == OP_VAR || e->type == OP_UNKNOWN) {
+    return 1;
+  } else if (e->type == OP_FUNC) {
+    if (!expr_is_eager(e)) {
+      return 0;
+    }
+    args = &e->param.func.args;
+  } else if ((e->type == OP_LOGICAL_AND || e->type == OP_LOGICAL_OR) &&
+             !expr_is_pure(&vec_nth(args, 1))) {
+    return 0;
+  }
+  for (int i = 0; i < vec_len(args); i++) {
+    if (!expr_batch_safe(&vec_nth(args, i))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Eager call, every argument gets a scratch level for its rows */
+static void expr_batch_call(struct expr_batch *b, struct expr *e,
+                            expr_num_t *out, expr_num_t *tmp) {
+  expr_num_t values[EXPR_CALL_ARGS];
+  int i, k, nargs = vec_len(&e->param.func.args);
+  for (k = 0; k < nargs; k++) {
+    expr_batch_eval(b, &vec_nth(&e->param.func.args, k),
+                    tmp + k * EXPR_BATCH_SIZE, tmp + (k + 1) * EXPR_BATCH_SIZE);
+  }
+  for (i = 0; i < b->n; i++) {
+    for (k = 0; k < nargs; k++) {
+      values[k] = tmp[k * EXPR_BATCH_SIZE + i];
+    }
+    out[i] = expr_call_eager(e, values);
+  }
+}
+
+/*
+ * Integer subtree, see expr_eval_int(). Integer rows are stored in the
+ * scratch levels, which are big enough for them.
+ */
+static void expr_batch_eval_int(struct expr_batch *b, struct expr *e,
+                                expr_int_t *out, expr_num_t *tmp) {
+  int i, n = b->n;
+  expr_int_t *t = (expr_int_t *)tmp;
+  if (e->type == OP_CONST) {
+    for (i = 0; i < n; i++) {
+      out[i] = to_int(e->param.num.value);
+    }
+    return;
+  } else if (!expr_is_int(e->type)) {
+    expr_batch_eval(b, e, tmp, tmp + EXPR_BATCH_SIZE);
+    for (i = 0; i < n; i++) {
+      out[i] = to_int(tmp[i]);
+    }
+    return;
+  }
+  expr_batch_eval_int(b, &e->param.op.args.buf[0], out, tmp);
+  if (e->type != OP_UNARY_BITWISE_NOT) {
+    expr_batch_eval_int(b, &e->param.op.args.buf[1], t,
+                        tmp + EXPR_BATCH_SIZE);
+  }
+  switch (e->type) {
+  case OP_UNARY_BITWISE_NOT:
+    for (i = 0; i < n; i++) {
+      out[i] = ~out[i];
+    }
+    break;
+  case OP_SHL:
+    for (i = 0; i < n; i++) {
+      out[i] = expr_shl(out[i], t[i]);
+    }
+    break;
+  case OP_SHR:
+    for (i = 0; i < n; i++) {
+      out[i] = expr_shr(out[i], t[i]);
+    }
+    break;
+  case OP_BITWISE_AND:
+    for (i = 0; i < n; i++) {
+      out[i] = out[i] & t[i];
+    }
+    break;
+  case OP_BITWISE_OR:
+    for (i = 0; i < n; i++) {
+      out[i] = out[i] | t[i];
+    }
+    break;
+  default:
+    for (i = 0; i < n; i++) {
+      out[i] = out[i] ^ t[i];
+    }
+    break;
+  }
+}
+
+static void expr_batch_eval(struct expr_batch *b, struct expr *e,
+                            expr_num_t *out, expr_num_t *tmp) {
+  int i, n = b->n;
+  expr_num_t *v;
+  if (expr_is_int(e->type)) {
+    expr_int_t *t = (expr_int_t *)tmp;
+    expr_batch_eval_int(b, e, t, tmp + EXPR_BATCH_SIZE);
+    for (i = 0; i < n; i++) {
+      out[i] = t[i];
+    }
+    return;
+  }
+  switch (e->type) {
+  case OP_CONST:
+    for (i = 0; i < n; i++) {
+      out[i] = e->param.num.value;
+    }
+    return;
+  case OP_VAR:
+    v = b->values + expr_batch_var(b, e->param.var.value) * EXPR_BATCH_SIZE;
+    memcpy(out, v, n * sizeof(expr_num_t));
+    return;
+  case OP_FUNC:
+    if (expr_is_eager(e)) {
+      expr_batch_call(b, e, out, tmp);
+    } else {
+      expr_batch_rows(b, e, out);
+    }
+    return;
+  case OP_ASSIGN:
+    expr_batch_eval(b, &e->param.op.args.buf[1], out, tmp);
+    if (vec_nth(&e->param.op.args, 0).type == OP_VAR) {
+      expr_num_t *value = e->param.op.args.buf[0].param.var.value;
+      v = b->values + expr_batch_var(b, value) * EXPR_BATCH_SIZE;
+      memcpy(v, out, n * sizeof(expr_num_t));
+    }
+    return;
+  case OP_COMMA:
+    expr_batch_eval(b, &e->param.op.args.buf[0], out, tmp);
+    expr_batch_eval(b, &e->param.op.args.buf[1], out, tmp);
+    return;
+  case OP_LOGICAL_AND:
+  case OP_LOGICAL_OR:
+    /* Both sides are evaluated and blended unless the right one has side
+       effects that must be skipped for short-circuited rows */
+    if (!expr_is_pure(&e->param.op.args.buf[1])) {
+      expr_batch_rows(b, e, out);
+      return;
+    }
+    break;
+  default:
+    break;
+  }
+  if (expr_is_unary(e->type)) {
+    expr_batch_eval(b, &e->param.op.args.buf[0], out, tmp);
+  } else if (expr_is_binary(e->type)) {
+    expr_batch_eval(b, &e->param.op.args.buf[0], out, tmp);
+    expr_batch_eval(b, &e->param.op.args.buf[1], tmp, tmp + EXPR_BATCH_SIZE);
+  }
+  switch (e->type) {
+  case OP_UNARY_MINUS:
+    for (i = 0; i < n; i++) {
+      out[i] = expr_neg(out[i]);
+    }
+    break;
+  case OP_UNARY_LOGICAL_NOT:
+    for (i = 0; i < n; i++) {
+      out[i] = !out[i];
+    }
+    break;
+  case OP_POWER:
+    for (i = 0; i < n; i++) {
+      out[i] = expr_pow(out[i], tmp[i]);
+    }
+    break;
+  case OP_MULTIPLY:
+    for (i = 0; i < n; i++) {
+      out[i] = expr_mul(out[i], tmp[i]);
+    }
+    break;
+  case OP_DIVIDE:
+    for (i = 0; i < n; i++) {
+      out[i] = expr_div(out[i], tmp[i]);
+    }
+    break;
+  case OP_REMAINDER:
+    for (i = 0; i < n; i++) {
+      out[i] = expr_fmod(out[i], tmp[i]);
+    }
+    break;
+  case OP_PLUS:
+    for (i = 0; i < n; i++) {
+      out[i] = expr_add(out[i], tmp[i]);
+    }
+    break;
+  case OP_MINUS:
+    for (i = 0; i < n; i++) {
+      out[i] = expr_sub(out[i], tmp[i]);
+    }
+    break;
+  case OP_LT:
+    for (i = 0; i < n; i++) {
+      out[i] = out[i] < tmp[i];
+    }
+    break;
+  case OP_LE:
+    for (i = 0; i < n; i++) {
+      out[i] = out[i] <= tmp[i];
+    }
+    break;
+  case OP_GT:
+    for (i = 0; i < n; i++) {
+      out[i] = out[i] > tmp[i];
+    }
+    break;
+  case OP_GE:
+    for (i = 0; i < n; i++) {
+      out[i] = out[i] >= tmp[i];
+    }
+    break;
+  case OP_EQ:
+    for (i = 0; i < n; i++) {
+      out[i] = out[i] == tmp[i];
+    }
+    break;
+  case OP_NE:
+    for (i = 0; i < n; i++) {
+      out[i] = out[i] != tmp[i];
+    }
+    break;
+  case OP_LOGICAL_AND:
+    for (i = 0; i < n; i++) {
+      out[i] = (out[i] == 0 || tmp[i] == 0) ? 0 : tmp[i];
+    }
+    break;
+  case OP_LOGICAL_OR:
+    for (i = 0; i < n; i++) {
+      out[i] = (out[i] != 0 && !expr_isnan(out[i])) ? out[i]
+                                               : (tmp[i] == 0 ? 0 : tmp[i]);
+    }
+    break;
+  default:
+    for (i = 0; i < n; i++) {
+      out[i] = EXPR_NAN;
+    }
+    break;
+  }
+}
+
+/* Fills the block with rows starting from row, bound[k] is column of vars[k] */
+static void expr_batch_load(struct expr_batch *b, struct expr_column *cols,
+                            const int *bound, size_t row) {
+  for (int k = 0; k < vec_len(&b->vars); k++) {
+    expr_num_t *v = b->values + k * EXPR_BATCH_SIZE;
+    struct expr_column *col = (bound[k] == -1 ? NULL : &cols[bound[k]]);
+    for (int i = 0; i < b->n; i++) {
+      v[i] = (col == NULL ? vec_nth(&b->init, k)
+                          : col->data[(row + i) * col->stride]);
+    }
+  }
+}
+
+/* Evaluates the loaded block with the batch kernel or the interpreter */
+static void expr_batch_run(struct expr_batch *b, struct expr *e,
+                           expr_num_t *out) {
+#if JIT
+  if (e->batchfn != NULL) {
+    e->batchfn(b->values, out, b->n);
+    return;
+  }
+#endif
+  expr_batch_eval(b, e, out, b->scratch);
+}
+
+/*
+ * Evaluates expression for n rows. Variables bound to columns take their
+ * values from the column, other variables start every row with the value they
+ * had before the call. After the call variables hold the values of the last
+ * row.
+ */
+EXPR_UNUSED
+static int expr_eval_batch(struct expr *e, struct expr_column *cols, int ncols,
+                           expr_num_t *out, size_t n) {
+  int i, k, depth;
+  int status = -1;
+  size_t row;
+  struct expr_batch b = {vec_init(), vec_init(), NULL, NULL, 0, {NULL, 0}};
+  int *bound = NULL;
+  for (i = 0; i < ncols; i++) {
+    if (cols[i].len < n) {
+      return -1; /* column is too short */
+    }
+  }
+  depth = expr_batch_collect(&b, e);
+  if (depth == -1) {
+    goto cleanup;
+  }
+  bound = (int *)malloc((vec_len(&b.vars) + 1) * sizeof(int));
+  if (bound == NULL) {
+    goto cleanup; /* allocation failed */
+  }
+  expr_batch_bind(&b.index, b.vars.buf, vec_len(&b.vars), cols, ncols, bound);
+  b.values = (expr_num_t *)malloc((vec_len(&b.vars) + depth + 1) *
+                                  EXPR_BATCH_SIZE * sizeof(expr_num_t));
+  if (b.values == NULL) {
+    goto cleanup; /* allocation failed */
+  }
+  b.scratch = b.values + vec_len(&b.vars) * EXPR_BATCH_SIZE;
+  for (row = 0; row < n; row += b.n) {
+    b.n = (n - row < EXPR_BATCH_SIZE ? (int)(n - row) : EXPR_BATCH_SIZE);
+    expr_batch_load(&b, cols, bound, row);
+    expr_batch_run(&b, e, out + row);
+  }
+  for (k = 0; k < vec_len(&b.vars); k++) {
+    if (n > 0) {
+      *vec_nth(&b.vars, k) = b.values[k * EXPR_BATCH_SIZE + b.n - 1];
+    }
+  }
+  status = 0;
+cleanup:
+  free(b.values);
+  free(bound);
+  expr_batch_free(&b);
+  return status;
+}
+
+/*
+ * Incremental evaluation: values of subtrees are kept between evaluations and
+ * recomputed only if a variable they read has changed. Changes are found by
+ * comparing variables with the values seen by the previous evaluation, so
+ * variables are still set directly. Assignments, calls of functions that are
+ * not pure and reads of variables assigned in the expression are evaluated
+ * every time, as well as the nodes above them.
+ */
+struct expr_incr_node {
+  struct expr *e;
+  expr_num_t value;
+  int parent;  /* -1 for the root */
+  int args[2]; /* child nodes, -1 if the subtree is evaluated as a whole */
+  int dirty;
+  int always; /* has side effects or reads assigned variables */
+};
+
+struct expr_incr_var {
+  expr_num_t *value;
+  expr_num_t last; /* value seen by the previous evaluation */
+  int uses;        /* first use or -1 */
+};
+
+struct expr_incr_use {
+  int node;
+  int next; /* next use of the same variable or -1 */
+};
+
+struct expr_incr {
+  struct expr *e;
+  vec(struct expr_incr_node) nodes;
+  vec(struct expr_incr_var) vars;
+  vec(struct expr_incr_use) uses;
+  vec_value_t assigned;
+  int recomputed; /* nodes recomputed by the last evaluation */
+};
+
+static int expr_incr_use(struct expr_incr *c, expr_num_t *value, int node) {
+  struct expr_incr_use use = {node, -1};
+  struct expr_incr_var v;
+  int i;
+  for (i = 0; i < vec_len(&c->vars); i++) {
+    if (vec_nth(&c->vars, i).value == value) {
+      break;
+    }
+  }
+  if (i == vec_len(&c->vars)) {
+    v.value = value;
+    v.last = *value;
+    v.uses = -1;
+    if (vec_push(&c->vars, v) == -1) {
+      return -1;
+    }
+  }
+  use.next = vec_nth(&c->vars, i).uses;
+  if (vec_push(&c->uses, use) == -1) {
+    return -1;
+  }
+  vec_nth(&c->vars, i).uses = vec_len(&c->uses) - 1;
+  return 0;
+}
+
+/*
+ * Adds uses of every variable of a subtree evaluated as a whole. Returns 1 if
+ * the subtree can be cached, 0 if not, -1 if memory can not be allocated.
+ */
+static int expr_incr_unit(struct expr_incr *c, struct expr *e, int node) {
+  int i, k, pure = 1;
+  vec_expr_t *args = &e->param.op.args;
+  if (e->type == OP_CONST || e->type == OP_UNKNOWN) {
+    return 1;
+  } else if (e->type == OP_VAR) {
+    if (expr_is_assigned(&c->assigned, e->param.var.value)) {
+      return 0;
+    }
+    return (expr_incr_use(c, e->param.var.value, node) == -1 ? -1 : 1);
+  } else if (e->type == OP_FUNC) {
+    args = &e->param.func.args;
+    pure = e->param.func.f->pure;
+  } else if (e->type == OP_ASSIGN) {
+    pure = 0;
+  }
+  for (i = 0; i < vec_len(args); i++) {
+    k = expr_incr_unit(c, &vec_nth(args, i), node);
+    if (k == -1) {
+      return -1;
+    }
+    pure = pure && k;
+  }
+  return pure;
+}
+
+/* Returns index of the node or -1 if memory can not be allocated */
+static int expr_incr_add(struct expr_incr *c, struct expr *e, int parent) {
+  struct expr_incr_node n;
+  int i, k, pure;
+  memset(&n, 0, sizeof(n));
+  n.e = e;
+  n.parent = parent;
+  n.args[0] = n.args[1] = -1;
+  n.dirty = 1;
+  if (vec_push(&c->nodes, n) == -1) {
+    return -1;
+  }
+  i = vec_len(&c->nodes) - 1;
+  if (e->type == OP_FUNC || e->type == OP_VAR || e->type == OP_CONST ||
+      e->type == OP_ASSIGN || e->type == OP_UNKNOWN || expr_is_int(e->type)) {
+    /* Integer subtrees are cached only as a whole, see expr_eval_int() */
+    pure = expr_incr_unit(c, e, i);
+    if (pure == -1) {
+      return -1;
+    }
+    vec_nth(&c->nodes, i).always = !pure;
+    return i;
+  }
+  for (k = 0; k < vec_len(&e->param.op.args) && k < 2; k++) {
+    int arg = expr_incr_add(c, &vec_nth(&e->param.op.args, k), i);
+    if (arg == -1) {
+      return -1;
+    }
+    vec_nth(&c->nodes, i).args[k] = arg;
+    vec_nth(&c->nodes, i).always |= vec_nth(&c->nodes, arg).always;
+  }
+  return i;
+}
+
+static void expr_incr_destroy(struct expr_incr *c) {
+  if (c != NULL) {
+    vec_free(&c->nodes);
+    vec_free(&c->vars);
+    vec_free(&c->uses);
+    vec_free(&c->assigned);
+    free(c);
+  }
+}
+
+/*
+ * Prepares incremental evaluation of the expression, which must outlive it
+ * and must not be modified. Returns NULL if memory can not be allocated.
+ */
+EXPR_UNUSED
+static struct expr_incr *expr_incr_create(struct expr *e) {
+  struct expr_incr *c = (struct expr_incr *)calloc(1, sizeof(*c));
+  if (c == NULL) {
+    return NULL; /* allocation failed */
+  }
+  c->e = e;
+  if (expr_assigned(&c->assigned, e) == -1 || expr_incr_add(c, e, -1) == -1) {
+    expr_incr_destroy(c);
+    return NULL;
+  }
+  return c;
+}
+
+static expr_num_t expr_incr_eval_node(struct expr_incr *c, int i) {
+  struct expr_incr_node *n = &vec_nth(&c->nodes, i);
+  expr_num_t a;
+  if (!n->dirty && !n->always) {
+    return n->value;
+  }
+  c->recomputed++;
+#define EXPR_INCR_A expr_incr_eval_node(c, n->args[0])
+#define EXPR_INCR_B expr_incr_eval_node(c, n->args[1])
+  if (n->args[0] == -1) {
+    a = expr_eval(n->e);
+  } else {
+    switch (n->e->type) {
+    case OP_UNARY_MINUS:
+      a = expr_neg(EXPR_INCR_A);
+      break;
+    case OP_UNARY_LOGICAL_NOT:
+      a = !EXPR_INCR_A;
+      break;
+    case OP_POWER:
+      a = EXPR_INCR_A;
+      a = expr_pow(a, EXPR_INCR_B);
+      break;
+    case OP_MULTIPLY:
+      a = EXPR_INCR_A;
+      a = expr_mul(a, EXPR_INCR_B);
+      break;
+    case OP_DIVIDE:
+      a = EXPR_INCR_A;
+      a = expr_div(a, EXPR_INCR_B);
+      break;
+    case OP_REMAINDER:
+      a = EXPR_INCR_A;
+      a = expr_fmod(a, EXPR_INCR_B);
+      break;
+    case OP_PLUS:
+      a = EXPR_INCR_A;
+      a = expr_add(a, EXPR_INCR_B);
+      break;
+    case OP_MINUS:
+      a = EXPR_INCR_A;
+      a = expr_sub(a, EXPR_INCR_B);
+      break;
+    case OP_LT:
+      a = EXPR_INCR_A;
+      a = a < EXPR_INCR_B;
+      break;
+    case OP_LE:
+      a = EXPR_INCR_A;
+      a = a <= EXPR_INCR_B;
+      break;
+    case OP_GT:
+      a = EXPR_INCR_A;
+      a = a > EXPR_INCR_B;
+      break;
+    case OP_GE:
+      a = EXPR_INCR_A;
+      a = a >= EXPR_INCR_B;
+      break;
+    case OP_EQ:
+      a = EXPR_INCR_A;
+      a = a == EXPR_INCR_B;
+      break;
+    case OP_NE:
+      a = EXPR_INCR_A;
+      a = a != EXPR_INCR_B;
+      break;
+    case OP_LOGICAL_AND:
+      a = (EXPR_INCR_A != 0 ? EXPR_INCR_B : 0);
+      a = (a != 0 ? a : 0);
+      break;
+    case OP_LOGICAL_OR:
+      a = EXPR_INCR_A;
+      if (a == 0 || expr_isnan(a)) {
+        a = EXPR_INCR_B;
+        a = (a != 0 ? a : 0);
+      }
+      break;
+    case OP_COMMA:
+      (void)EXPR_INCR_A;
+      a = EXPR_INCR_B;
+      break;
+    default:
+      a = expr_eval(n->e);
+      break;
+    }
+  }
+#undef EXPR_INCR_A
+#undef EXPR_INCR_B
+  n->value = a;
+  n->dirty = 0;
+  return a;
+}
+
+/*
+ * Evaluates the expression recomputing only the subtrees that depend on
+ * variables changed since the previous evaluation. The result is the same as
+ * of expr_eval().
+ */
+EXPR_UNUSED
+static expr_num_t expr_eval_incremental(struct expr_incr *c) {
+  int i, u, node;
+  for (i = 0; i < vec_len(&c->vars); i++) {
+    struct expr_incr_var *v = &vec_nth(&c->vars, i);
+    if (memcmp(v->value, &v->last, sizeof(expr_num_t)) == 0) {
+      continue;
+    }
+    v->last = *v->value;
+    for (u = v->uses; u != -1; u = vec_nth(&c->uses, u).next) {
+      for (node = vec_nth(&c->uses, u).node;
+           node != -1 && !vec_nth(&c->nodes, node).dirty;
+           node = vec_nth(&c->nodes, node).parent) {
+        vec_nth(&c->nodes, node).dirty = 1;
+      }
+    }
+  }
+  c->recomputed = 0;
+  return expr_incr_eval_node(c, 0);
+}
+
+/*
+ * Program: many expressions compiled against one environment into a single
+ * unit. Every expression is assigned to a result variable of the program, and
+ * subtrees common to all of them are computed once per evaluation.
+ */
+struct expr_program {
+  struct expr *root; /* $0 = ..., $1 = ..., ... in a balanced comma tree */
+  struct expr_code *code;
+  struct expr_var_list locals; /* results and shared subtrees */
+  expr_num_t **results;
+  int n;
+  int shared; /* subtrees shared by expr_cse() */
+};
+
+static void expr_program_destroy(struct expr_program *p) {
+  if (p != NULL) {
+    expr_code_destroy(p->code);
+    expr_destroy(p->root, &p->locals);
+    free(p->results);
+    free(p);
+  }
+}
+
+/*
+ * Compiles n expressions, which are evaluated in the given order. Returns
+ * NULL on a syntax error or if memory can not be allocated.
+ */
+EXPR_UNUSED
+static struct expr_program *
+expr_program_create(const char **s, int n, struct expr_var_list *vars,
+                    struct expr_func_registry *funcs) {
+  struct expr_program *p =
+      (struct expr_program *)calloc(1, sizeof(struct expr_program));
+  vec_expr_t rules = vec_init();
+  char name[16];
+  int i, k;
+  if (p == NULL) {
+    return NULL; /* allocation failed */
+  }
+  p->n = n;
+  p->results = (expr_num_t **)calloc(n + 1, sizeof(expr_num_t *));
+  p->root = (struct expr *)calloc(1, sizeof(struct expr));
+  if (p->results == NULL || p->root == NULL) {
+    goto fail;
+  }
+  p->root->type = OP_CONST;
+  for (i = 0; i < n; i++) {
+    struct expr assign = expr_init();
+    struct expr_var *v;
+    struct expr *e = expr_create_ex(s[i], strlen(s[i]), vars, funcs, NULL);
+    if (e == NULL) {
+      goto fail;
+    }
+#if JIT
+    expr_jit_release(e);
+#endif
+    snprintf(name, sizeof(name), "$%d", i);
+    v = expr_var(&p->locals, name, strlen(name));
+    assign.type = OP_ASSIGN;
+    if (v == NULL || expr_alloc_args(NULL, &assign.param.op.args, 2) == -1 ||
+        vec_push(&rules, assign) == -1) {
+      vec_free(&assign.param.op.args);
+      expr_destroy(e, NULL);
+      goto fail;
+    }
+    vec_nth(&assign.param.op.args, 0) = expr_varref(v);
+    vec_nth(&assign.param.op.args, 1) = *e;
+    free(e);
+    p->results[i] = &v->value;
+  }
+  /* Pairs are joined level by level, so the tree is only log(n) deep */
+  while (vec_len(&rules) > 1) {
+    for (i = 0, k = 0; i < vec_len(&rules); i += 2, k++) {
+      struct expr comma = expr_init();
+      if (i + 1 == vec_len(&rules)) {
+        vec_nth(&rules, k) = vec_nth(&rules, i);
+        continue;
+      }
+      comma.type = OP_COMMA;
+      if (expr_alloc_args(NULL, &comma.param.op.args, 2) == -1) {
+        while (i < vec_len(&rules)) {
+          vec_nth(&rules, k++) = vec_nth(&rules, i++);
+        }
+        rules.len = k;
+        goto fail;
+      }
+      vec_nth(&comma.param.op.args, 0) = vec_nth(&rules, i);
+      vec_nth(&comma.param.op.args, 1) = vec_nth(&rules, i + 1);
+      vec_nth(&rules, k) = comma;
+    }
+    rules.len = k;
+  }
+  if (vec_len(&rules) > 0) {
+    *p->root = vec_pop(&rules);
+  }
+  vec_free(&rules);
+  p->shared = expr_cse(p->root, &p->locals);
+  p->code = expr_code_create(p->root);
+  if (p->shared == -1 || p->code == NULL) {
+    expr_program_destroy(p);
+    return NULL;
+  }
+#if JIT
+  if (p->root->fn == NULL) {
+    p->root->fn = expr_compile(p->root, &p->root->jitsz);
+  }
+#endif
+  return p;
+fail:
+  for (i = 0; i < vec_len(&rules); i++) {
+    expr_destroy_args(&vec_nth(&rules, i));
+  }
+  vec_free(&rules);
+  expr_program_destroy(p);
+  return NULL;
+}
+
+/* Evaluates all expressions and writes their results into out */
+EXPR_UNUSED
+static void expr_program_eval(struct expr_program *p, expr_num_t *out) {
+  int i;
+#if JIT
+  if (p->root->fn != NULL) {
+    (void)expr_eval(p->root);
+  } else {
+    (void)expr_code_eval(p->code);
+  }
+#else
+  (void)expr_code_eval(p->code);
+#endif
+  for (i = 0; i < p->n; i++) {
+    out[i] = *p->results[i];
+  }
+}
+
+/*
+ * Serialization: compiled expressions and programs are written in a binary
+ * format and loaded back without parsing, e.g. right from a mapped file.
+ * Numbers are stored as in memory, so the loader rejects files written with
+ * another byte order or number type. Functions are stored by name and bound
+ * again on load, macros are stored with their bodies.
+ *
+ *   header  "EXPR", version, byte order mark, number type, 0 for expression
+ *           or 1 for program
+ *   macros  count, then name, pure flag and number of parameters of each
+ *   vars    count, then scope and name of each: 0 is the caller's list, 1 the
+ *           program's own variables, 2 + m parameters of macro m
+ *   funcs   count, then 0 and name of a function or 1 + index of a macro
+ *   bodies  tree of each macro
+ *   root    tree of the expression
+ *   program number of results, number of shared subtrees, variable of each
+ *           result
+ *
+ * Integers are 32-bit, strings are length and bytes. Trees are in prefix
+ * order: node type byte, then the number of a constant, variable index,
+ * or function index and number of arguments, followed by the operands.
+ * Trees nested deeper than EXPR_SAVE_DEPTH are neither written nor read.
+ */
+#define EXPR_SAVE_VERSION 1
+#define EXPR_SAVE_BOM 0x01020304u
+#define EXPR_SAVE_NUM ((unsigned int)sizeof(expr_num_t) * 2 + EXPR_INT64)
+#define EXPR_SAVE_DEPTH 10000
+
+struct expr_writer {
+  FILE *f;
+  vec_value_t vars;
+  vec(int) scopes;
+  vec(struct expr_func *) funcs;
+  vec(struct expr_macro *) macros;
+  struct expr_var_list *locals; /* program variables or NULL */
+  int depth;
+  int error;
+};
+
+static int expr_writer_find(vec_value_t *vars, expr_num_t *value) {
+  int i;
+  for (i = 0; i < vec_len(vars); i++) {
+    if (vec_nth(vars, i) == value) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int expr_writer_func(struct expr_writer *w, struct expr_func *f) {
+  int i;
+  for (i = 0; i < vec_len(&w->funcs); i++) {
+    if (vec_nth(&w->funcs, i) == f) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int expr_writer_macro(struct expr_writer *w, struct expr_macro *m) {
+  int i;
+  for (i = 0; i < vec_len(&w->macros); i++) {
+    if (vec_nth(&w->macros, i) == m) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int expr_list_has(struct expr_var_list *vars, expr_num_t *value) {
+  struct expr_var *v;
+  for (v = (vars != NULL ? vars->head : NULL); v; v = v->next) {
+    if (&v->value == value) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Collects variables, functions and macros used in the tree of macro m */
+static void expr_writer_collect(struct expr_writer *w, struct expr *e,
+                                int m) {
+  vec_expr_t *args = &e->param.op.args;
+  int i, scope = 0;
+  if (e->type == OP_CONST || e->type == OP_UNKNOWN) {
+    return;
+  } else if (w->depth >= EXPR_SAVE_DEPTH) {
+    w->error = 1;
+    return;
+  } else if (e->type == OP_VAR) {
+    expr_num_t *value = e->param.var.value;
+    if (expr_writer_find(&w->vars, value) != -1) {
+      return;
+    }
+    if (m != -1 && expr_list_has(&vec_nth(&w->macros, m)->params, value)) {
+      scope = 2 + m;
+    } else if (expr_list_has(w->locals, value)) {
+      scope = 1;
+    }
+    if (vec_push(&w->vars, value) == -1 || vec_push(&w->scopes, scope) == -1) {
+      w->error = 1;
+    }
+    return;
+  } else if (e->type == OP_FUNC) {
+    struct expr_func *f = e->param.func.f;
+    args = &e->param.func.args;
+    if (expr_writer_func(w, f) == -1) {
+      if (f->f == expr_macro_call) {
+        struct expr_macro *mc = (struct expr_macro *)f;
+        if (vec_push(&w->macros, mc) == -1) {
+          w->error = 1;
+          return;
+        }
+        w->depth++;
+        expr_writer_collect(w, &mc->body, vec_len(&w->macros) - 1);
+        w->depth--;
+      }
+      if (vec_push(&w->funcs, f) == -1) {
+        w->error = 1;
+        return;
+      }
+    }
+  }
+  w->depth++;
+  for (i = 0; i < vec_len(args) && !w->error; i++) {
+    expr_writer_collect(w, &vec_nth(args, i), m);
+  }
+  w->depth--;
+}
+
+static void expr_write_u32(struct expr_writer *w, unsigned int n) {
+  unsigned int u = n;
+  if (fwrite(&u, sizeof(u), 1, w->f) != 1) {
+    w->error = 1;
+  }
+}
+
+static void expr_write_str(struct expr_writer *w, const char *s) {
+  size_t len = strlen(s);
+  expr_write_u32(w, (unsigned int)len);
+  if (fwrite(s, 1, len, w->f) != len) {
+    w->error = 1;
+  }
+}
+
+/* Depth was already checked by expr_writer_collect() */
+static void expr_write_tree(struct expr_writer *w, struct expr *e) {
+  vec_expr_t *args = &e->param.op.args;
+  int i;
+  if (fputc(e->type, w->f) == EOF) {
+    w->error = 1;
+  }
+  if (e->type == OP_CONST) {
+    if (fwrite(&e->param.num.value, sizeof(expr_num_t), 1, w->f) != 1) {
+      w->error = 1;
+    }
+    return;
+  } else if (e->type == OP_VAR) {
+    expr_write_u32(w, expr_writer_find(&w->vars, e->param.var.value));
+    return;
+  } else if (e->type == OP_UNKNOWN) {
+    return;
+  } else if (e->type == OP_FUNC) {
+    args = &e->param.func.args;
+    expr_write_u32(w, expr_writer_func(w, e->param.func.f));
+    expr_write_u32(w, vec_len(args));
+  }
+  for (i = 0; i < vec_len(args) && !w->error; i++) {
+    expr_write_tree(w, &vec_nth(args, i));
+  }
+}
+
+static int expr_writer_run(FILE *f, struct expr *root,
+                           struct expr_program *p) {
+  struct expr_writer w = {f, vec_init(), vec_init(), vec_init(), vec_init(),
+                          NULL, 0, 0};
+  struct expr_macro *m;
+  struct expr_func *fn;
+  int i, k;
+  w.locals = (p != NULL ? &p->locals : NULL);
+  expr_writer_collect(&w, root, -1);
+  if (!w.error) {
+    if (fwrite("EXPR", 1, 4, f) != 4) {
+      w.error = 1;
+    }
+    expr_write_u32(&w, EXPR_SAVE_VERSION);
+    expr_write_u32(&w, EXPR_SAVE_BOM);
+    expr_write_u32(&w, EXPR_SAVE_NUM);
+    expr_write_u32(&w, p != NULL);
+    expr_write_u32(&w, vec_len(&w.macros));
+    vec_foreach(&w.macros, m, i) {
+      expr_write_str(&w, m->name);
+      expr_write_u32(&w, m->func.pure);
+      expr_write_u32(&w, m->nparams);
+    }
+    expr_write_u32(&w, vec_len(&w.vars));
+    for (i = 0; i < vec_len(&w.vars); i++) {
+      expr_write_u32(&w, vec_nth(&w.scopes, i));
+      expr_write_str(&w, expr_var_of(vec_nth(&w.vars, i))->name);
+    }
+    expr_write_u32(&w, vec_len(&w.funcs));
+    vec_foreach(&w.funcs, fn, i) {
+      k = (fn->f == expr_macro_call
+               ? expr_writer_macro(&w, (struct expr_macro *)fn)
+               : -1);
+      expr_write_u32(&w, k + 1);
+      if (k == -1) {
+        expr_write_str(&w, fn->name);
+      }
+    }
+    vec_foreach(&w.macros, m, i) { expr_write_tree(&w, &m->body); }
+    expr_write_tree(&w, root);
+    if (p != NULL) {
+      expr_write_u32(&w, p->n);
+      expr_write_u32(&w, p->shared);
+      for (i = 0; i < p->n; i++) {
+        expr_write_u32(&w, expr_writer_find(&w.vars, p->results[i]));
+      }
+    }
+  }
+  vec_free(&w.vars);
+  vec_free(&w.scopes);
+  vec_free(&w.funcs);
+  vec_free(&w.macros);
+  return (w.error ? -1 : 0);
+}
+
+/* Writes the expression to the file, returns -1 on error */
+EXPR_UNUSED
+static int expr_write(struct expr *e, FILE *f) {
+  return expr_writer_run(f, e, NULL);
+}
+
+/* Writes the program to the file, returns -1 on error */
+EXPR_UNUSED
+static int expr_program_write(struct expr_program *p, FILE *f) {
+  return expr_writer_run(f, p->root, p);
+}
+
+struct expr_reader {
+  const unsigned char *p;
+  const unsigned char *end;
+  struct expr_arena *arena;
+  expr_num_t **vars;
+  struct expr_func **funcs;
+  struct expr_macro **macros;
+  unsigned int nvars;
+  unsigned int nfuncs;
+  unsigned int nmacros;
+  int depth;
+  int error;
+};
+
+static unsigned int expr_read_u32(struct expr_reader *r) {
+  unsigned int n = 0;
+  if (r->end - r->p < (ptrdiff_t)sizeof(n)) {
+    r->error = 1;
+    return 0;
+  }
+  memcpy(&n, r->p, sizeof(n));
+  r->p += sizeof(n);
+  return n;
+}
+
+/* Returns a string of the buffer, not terminated, or NULL */
+static const char *expr_read_str(struct expr_reader *r, size_t *len) {
+  const char *s;
+  *len = expr_read_u32(r);
+  if (r->error || (size_t)(r->end - r->p) < *len) {
+    r->error = 1;
+    return NULL;
+  }
+  s = (const char *)r->p;
+  r->p += *len;
+  return s;
+}
+
+/* Reads a count of items taking at least size bytes each */
+static unsigned int expr_read_count(struct expr_reader *r, size_t size) {
+  unsigned int n = expr_read_u32(r);
+  if ((size_t)(r->end - r->p) / size < n) {
+    r->error = 1;
+    return 0;
+  }
+  return n;
+}
+
+static void expr_read_tree(struct expr_reader *r, struct expr *e) {
+  vec_expr_t *args = &e->param.op.args;
+  unsigned int type, k, n;
+  if (r->p >= r->end) {
+    r->error = 1;
+    return;
+  }
+  type = *r->p++;
+  if (r->depth >= EXPR_SAVE_DEPTH) {
+    r->error = 1;
+    return;
+  } else if (type == OP_CONST) {
+    if (r->end - r->p < (ptrdiff_t)sizeof(expr_num_t)) {
+      r->error = 1;
+      return;
+    }
+    memcpy(&e->param.num.value, r->p, sizeof(expr_num_t));
+    r->p += sizeof(expr_num_t);
+    e->type = OP_CONST;
+    return;
+  } else if (type == OP_VAR) {
+    k = expr_read_u32(r);
+    if (r->error || k >= r->nvars) {
+      r->error = 1;
+      return;
+    }
+    e->type = OP_VAR;
+    e->param.var.value = r->vars[k];
+    return;
+  } else if (type == OP_UNKNOWN) {
+    e->type = OP_UNKNOWN;
+    return;
+  } else if (type == OP_FUNC) {
+    struct expr_func *f;
+    k = expr_read_u32(r);
+    n = expr_read_count(r, 1);
+    if (r->error || k >= r->nfuncs) {
+      r->error = 1;
+      return;
+    }
+    f = r->funcs[k];
+    args = &e->param.func.args;
+    if (expr_alloc_args(r->arena, args, n) == -1) {
+      r->error = 1;
+      return;
+    }
+    e->type = OP_FUNC;
+    e->param.func.f = f;
+    if (f->ctxsz > 0) {
+      e->param.func.context = expr_alloc_context(r->arena, f);
+      if (e->param.func.context == NULL) {
+        r->error = 1;
+        return;
+      }
+      if (f->f == expr_macro_call) {
+        ((struct expr_macro *)f)->refs++;
+      }
+    }
+  } else if (type < OP_CONST && (expr_is_unary((enum expr_type)type) ||
+                                 expr_is_binary((enum expr_type)type))) {
+    n = (expr_is_unary((enum expr_type)type) ? 1 : 2);
+    if (expr_alloc_args(r->arena, args, n) == -1) {
+      r->error = 1;
+      return;
+    }
+    e->type = (enum expr_type)type;
+  } else {
+    r->error = 1;
+    return;
+  }
+  r->depth++;
+  for (k = 0; k < n && !r->error; k++) {
+    expr_read_tree(r, &vec_nth(args, k));
+  }
+  r->depth--;
+}
+
+/*
+ * Reads everything before the root: macros, variables and functions. Macros
+ * are released by expr_reader_free(), call sites keep their own references.
+ */
+static int expr_reader_init(struct expr_reader *r, const void *buf,
+                            size_t len, unsigned int kind,
+                            struct expr_var_list *vars,
+                            struct expr_var_list *locals,
+                            struct expr_func_registry *funcs,
+                            struct expr_arena *arena) {
+  struct expr_func_registry none = {NULL, NULL, 0};
+  unsigned int i, k, count;
+  size_t n;
+  const char *s;
+  memset(r, 0, sizeof(*r));
+  r->p = (const unsigned char *)buf;
+  r->end = r->p + len;
+  r->arena = arena;
+  funcs = (funcs != NULL ? funcs : &none);
+  if (len < 4 || memcmp(buf, "EXPR", 4) != 0) {
+    return -1; /* not an expression */
+  }
+  r->p += 4;
+  if (expr_read_u32(r) != EXPR_SAVE_VERSION ||
+      expr_read_u32(r) != EXPR_SAVE_BOM ||
+      expr_read_u32(r) != EXPR_SAVE_NUM || expr_read_u32(r) != kind) {
+    return -1; /* another version, byte order or number type */
+  }
+  count = expr_read_count(r, 12);
+  r->macros =
+      (struct expr_macro **)calloc(count + 1, sizeof(struct expr_macro *));
+  if (r->macros == NULL) {
+    return -1;
+  }
+  for (i = 0; i < count; i++) {
+    struct expr_macro *m;
+    s = expr_read_str(r, &n);
+    k = expr_read_u32(r); /* pure */
+    if (r->error) {
+      return -1;
+    }
+    m = (struct expr_macro *)calloc(1, sizeof(struct expr_macro) + n + 1);
+    if (m == NULL) {
+      return -1;
+    }
+    r->macros[r->nmacros++] = m;
+    memcpy(m->name, s, n);
+    m->func.name = m->name;
+    m->func.f = expr_macro_call;
+    m->func.cleanup = expr_macro_cleanup;
+    m->func.ctxsz = 1;
+    m->func.pure = (k != 0);
+    m->refs = 1;
+    m->body = expr_const(0);
+    m->nparams = (int)expr_read_u32(r);
+    if (m->nparams < 0 || m->nparams > EXPR_MACRO_PARAMS) {
+      return -1;
+    }
+    if (m->nparams > 0) {
+      m->slots = (expr_num_t **)calloc(m->nparams, sizeof(expr_num_t *));
+      if (m->slots == NULL) {
+        return -1;
+      }
+    }
+  }
+  r->nvars = expr_read_count(r, 8);
+  r->vars = (expr_num_t **)calloc(r->nvars + 1, sizeof(expr_num_t *));
+  if (r->error || r->vars == NULL) {
+    return -1;
+  }
+  for (i = 0; i < r->nvars; i++) {
+    struct expr_var *v = NULL;
+    unsigned int scope = expr_read_u32(r);
+    s = expr_read_str(r, &n);
+    if (r->error) {
+      return -1;
+    } else if (scope == 0 && n > 1 && s[0] == '$' && s[1] == '@') {
+      v = expr_var_temp(vars); /* a new temporary of this expression */
+    } else if (scope == 0) {
+      v = expr_var(vars, s, n);
+    } else if (scope == 1 && locals != NULL) {
+      v = expr_var(locals, s, n);
+    } else if (scope >= 2 && scope - 2 < r->nmacros) {
+      struct expr_macro *m = r->macros[scope - 2];
+      v = expr_var(&m->params, s, n);
+      k = (v != NULL ? (unsigned int)expr_macro_param(v->name) : 0);
+      if (v != NULL && k >= (unsigned int)m->nparams) {
+        return -1; /* not a parameter */
+      } else if (v != NULL) {
+        m->slots[k] = &v->value;
+      }
+    }
+    if (v == NULL) {
+      return -1;
+    }
+    r->vars[i] = &v->value;
+  }
+  r->nfuncs = expr_read_count(r, 4);
+  r->funcs = (struct expr_func **)calloc(r->nfuncs + 1,
+                                         sizeof(struct expr_func *));
+  if (r->error || r->funcs == NULL) {
+    return -1;
+  }
+  for (i = 0; i < r->nfuncs; i++) {
+    k = expr_read_u32(r);
+    if (k == 0) {
+      s = expr_read_str(r, &n);
+      r->funcs[i] = (s != NULL ? expr_func_lookup(funcs, s, n) : NULL);
+    } else if (k - 1 < r->nmacros) {
+      r->funcs[i] = &r->macros[k - 1]->func;
+    }
+    if (r->funcs[i] == NULL) {
+      return -1; /* unknown function */
+    }
+  }
+  for (i = 0; i < r->nmacros && !r->error; i++) {
+    expr_read_tree(r, &r->macros[i]->body);
+  }
+  /* Bodies may call macros stored after them, so repeat until nothing new
+     is found */
+  for (k = 1, count = 0; k != count && !r->error;) {
+    k = count;
+    for (i = 0, count = 0; i < r->nmacros && !r->error; i++) {
+      if (expr_assigned(&r->macros[i]->assigned, &r->macros[i]->body) == -1) {
+        r->error = 1;
+      }
+      count += vec_len(&r->macros[i]->assigned);
+    }
+  }
+#if JIT
+  for (i = 0; i < r->nmacros && !r->error; i++) {
+    r->macros[i]->body.fn =
+        expr_compile(&r->macros[i]->body, &r->macros[i]->body.jitsz);
+  }
+#endif
+  return (r->error ? -1 : 0);
+}
+
+static void expr_reader_free(struct expr_reader *r) {
+  unsigned int i;
+  for (i = 0; r->macros != NULL && i < r->nmacros; i++) {
+    expr_macro_release(r->macros[i]);
+  }
+  free(r->macros);
+  free(r->vars);
+  free(r->funcs);
+}
+
+/*
+ * Loads an expression written by expr_write() from the buffer, binding its
+ * variables to vars and functions by name to funcs. Nodes are taken from the
+ * arena unless it's NULL. Returns NULL if the data is invalid, a function is
+ * unknown or memory can not be allocated.
+ */
+EXPR_UNUSED
+static struct expr *expr_load(const void *buf, size_t len,
+                              struct expr_var_list *vars,
+                              struct expr_func_registry *funcs,
+                              struct expr_arena *arena) {
+  struct expr_reader r;
+  struct expr *e = NULL;
+  if (expr_reader_init(&r, buf, len, 0, vars, NULL, funcs, arena) == 0) {
+    if (arena != NULL) {
+      e = (struct expr *)expr_arena_alloc(arena, sizeof(struct expr));
+#if JIT
+      if (e != NULL && vec_push(&arena->roots, e) == -1) {
+        e = NULL;
+      }
+#endif
+    } else {
+      e = (struct expr *)calloc(1, sizeof(struct expr));
+    }
+  }
+  if (e != NULL) {
+    expr_read_tree(&r, e);
+    if (r.error || r.p != r.end) {
+      if (arena == NULL) {
+        expr_destroy(e, NULL);
+      }
+      e = NULL;
+    }
+  }
+#if JIT
+  if (e != NULL) {
+    e->fn = expr_compile(e, &e->jitsz);
+    e->batchfn = expr_compile_batch(e, &e->batchsz);
+  }
+#endif
+  expr_reader_free(&r);
+  return e;
+}
+
+/* Loads a program written by expr_program_write(), like expr_load() */
+EXPR_UNUSED
+static struct expr_program *
+expr_program_load(const void *buf, size_t len, struct expr_var_list *vars,
+                  struct expr_func_registry *funcs) {
+  struct expr_program *p =
+      (struct expr_program *)calloc(1, sizeof(struct expr_program));
+  struct expr_reader r;
+  unsigned int i, k;
+  if (p == NULL) {
+    return NULL; /* allocation failed */
+  }
+  if (expr_reader_init(&r, buf, len, 1, vars, &p->locals, funcs, NULL) == 0 &&
+      (p->root = (struct expr *)calloc(1, sizeof(struct expr))) != NULL) {
+    expr_read_tree(&r, p->root);
+    p->n = (int)expr_read_count(&r, 4);
+    p->shared = (int)expr_read_u32(&r);
+    p->results = (expr_num_t **)calloc(p->n + 1, sizeof(expr_num_t *));
+    for (i = 0; p->results != NULL && i < (unsigned int)p->n; i++) {
+      k = expr_read_u32(&r);
+      if (k >= r.nvars) {
+        r.error = 1;
+        break;
+      }
+      p->results[i] = r.vars[k];
+    }
+    if (!r.error && r.p == r.end && p->results != NULL) {
+      p->code = expr_code_create(p->root);
+    }
+  }
+  expr_reader_free(&r);
+  if (p->code == NULL) {
+    expr_program_destroy(p);
+    return NULL;
+  }
+#if JIT
+  p->root->fn = expr_compile(p->root, &p->root->jitsz);
+#endif
+  return p;
 }
 
 #ifdef __cplusplus
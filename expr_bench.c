@@ -0,0 +1,429 @@
+/*
+ * expr_bench: times parsing, evaluation, destruction and JIT compilation of
+ * expressions and prints the results as JSON.
+ *
+ *   expr_bench [expr...]
+ *
+ * Without arguments it also parses, evaluates and destroys generated scripts
+ * and operator chains of 10k, 100k and 1M tokens, timed per token. Parsing is
+ * timed with the JIT disabled, JIT compilation is timed separately.
+ * Every phase is timed in BENCH_SAMPLES samples after BENCH_WARMUP samples
+ * that are thrown away. A sample is a batch of operations long enough for the
+ * clock, its time per operation is one value of the percentiles. Allocations
+ * are counted by wrapping malloc, calloc and realloc of expr.h.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static size_t bench_allocs;
+
+static void *bench_malloc(size_t n) {
+  bench_allocs++;
+  return malloc(n);
+}
+
+static void *bench_calloc(size_t n, size_t size) {
+  bench_allocs++;
+  return calloc(n, size);
+}
+
+static void *bench_realloc(void *p, size_t n) {
+  bench_allocs++;
+  return realloc(p, n);
+}
+
+#define malloc(n) bench_malloc(n)
+#define calloc(n, size) bench_calloc(n, size)
+#define realloc(p, n) bench_realloc(p, n)
+
+#if JIT
+#include "expr_jit.c"
+#else
+#include "expr.h"
+#endif
+
+#undef malloc
+#undef calloc
+#undef realloc
+
+#ifndef BENCH_SAMPLES
+#define BENCH_SAMPLES 101
+#endif
+#define BENCH_WARMUP 10
+#define BENCH_PARSE_OPS 64   /* expressions parsed per sample */
+#define BENCH_SAMPLE_NS 20000 /* shortest evaluation sample */
+
+#define BENCH_SCRIPT_SAMPLES 11
+
+struct bench_stats {
+  const char *phase;
+  int samples;
+  double ns[BENCH_SAMPLES]; /* per operation */
+  size_t allocs;
+  long ops;
+};
+
+static const char *bench_exprs[] = {
+    "5",
+    "5+5+5+5+5+5+5+5+5+5",
+    "5*5*5*5*5*5*5*5*5*5",
+    "5,5,5,5,5,5,5,5,5,5",
+    "((5+5)+(5+5))+((5+5)+(5+5))+(5+5)",
+    "x=5",
+    "x=5,x+x+x+x+x+x+x+x+x+x",
+    "x=5,((x+x)+(x+x))+((x+x)+(x+x))+(x+x)",
+    "a=1,b=2,c=3,d=4,e=5,f=6,g=7,h=8,i=9,j=10",
+    "a=1,a=2,a=3,a=4,a=5,a=6,a=7,a=8,a=9,a=10",
+    "$(sqr,$1*$1),5*5",
+    "$(sqr,$1*$1),sqr(5)",
+    "x=2+3*(x/(42+next(x))),x",
+    "add(next(x), next(next(x)))",
+    "a,b,c,d,e,d,e,f,g,h,i,j,k",
+    "$(a,1),$(b,2),$(c,3),$(d,4),5",
+};
+
+static expr_num_t bench_add(struct expr_func *f, vec_expr_t *args, void *c) {
+  (void)f, (void)c;
+  return expr_eval(&vec_nth(args, 0)) + expr_eval(&vec_nth(args, 1));
+}
+
+static expr_num_t bench_next(struct expr_func *f, vec_expr_t *args, void *c) {
+  (void)f, (void)c;
+  return expr_eval(&vec_nth(args, 0)) + 1;
+}
+
+static struct expr_func bench_funcs[] = {
+    {"add", bench_add, NULL, 0, 1, 0},
+    {"next", bench_next, NULL, 0, 1, 0},
+    {NULL, NULL, NULL, 0, 0, 0},
+};
+
+static double bench_now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/* Records a sample of n operations started at the given time and count */
+static void bench_record(struct bench_stats *st, int sample, double start,
+                         size_t allocs, long n) {
+  double ns = (bench_now() - start) / n;
+  if (sample >= 0) {
+    st->ns[sample] = ns;
+    st->allocs += bench_allocs - allocs;
+    st->ops += n;
+  }
+}
+
+static int bench_cmp(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void bench_json_str(const char *s) {
+  putchar('"');
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') {
+      printf("\\%c", *s);
+    } else if ((unsigned char)*s < ' ') {
+      printf("\\u%04x", *s);
+    } else {
+      putchar(*s);
+    }
+  }
+  putchar('"');
+}
+
+static void bench_report(const char *s, struct bench_stats *st, int *first) {
+  double *ns = st->ns, mean = 0;
+  int i, n = st->samples;
+  qsort(ns, n, sizeof(double), bench_cmp);
+  for (i = 0; i < n; i++) {
+    mean += ns[i] / n;
+  }
+  printf("%s\n    {\"expr\": ", (*first ? "" : ","));
+  bench_json_str(s);
+  printf(", \"phase\": \"%s\", \"samples\": %d, \"ops\": %ld,\n"
+         "     \"ns_per_op\": {\"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, "
+         "\"p99\": %.3f, \"max\": %.3f, \"mean\": %.3f},\n"
+         "     \"allocs_per_op\": %.3f}",
+         st->phase, n, st->ops, ns[0], ns[n / 2], ns[n * 9 / 10],
+         ns[n * 99 / 100], ns[n - 1], mean,
+         (double)st->allocs / (st->ops > 0 ? st->ops : 1));
+  *first = 0;
+}
+
+/* Returns number of evaluations taking at least BENCH_SAMPLE_NS */
+static long bench_calibrate(struct expr *e) {
+  long n, i;
+  for (n = 1; n < (1L << 30); n = n * 2) {
+    double start = bench_now();
+    for (i = 0; i < n; i++) {
+      expr_eval(e);
+    }
+    if (bench_now() - start >= BENCH_SAMPLE_NS) {
+      break;
+    }
+  }
+  return n;
+}
+
+/* Parsing is timed without JIT compilation, which is a phase of its own */
+static void bench_jit(int enabled) {
+#if JIT
+  expr_jit_enabled = enabled;
+#else
+  (void)enabled;
+#endif
+}
+
+static int bench_expr(const char *s, int *first) {
+  struct expr_var_list vars = {0};
+  struct expr *parsed[BENCH_PARSE_OPS];
+  struct bench_stats parse = {"parse", BENCH_SAMPLES, {0}, 0, 0};
+  struct bench_stats destroy = {"destroy", BENCH_SAMPLES, {0}, 0, 0};
+  struct bench_stats eval = {"eval", BENCH_SAMPLES, {0}, 0, 0};
+  struct bench_stats code = {"eval_bytecode", BENCH_SAMPLES, {0}, 0, 0};
+  struct bench_stats flat = {"eval_flat", BENCH_SAMPLES, {0}, 0, 0};
+#if JIT
+  struct bench_stats jit = {"jit_compile", BENCH_SAMPLES, {0}, 0, 0};
+  struct bench_stats native = {"eval_jit", BENCH_SAMPLES, {0}, 0, 0};
+  expr_jit_fn_t fn;
+#endif
+  struct expr_code *c;
+  struct expr_flat *f;
+  struct expr *e;
+  size_t allocs;
+  double start;
+  long i, n;
+  int sample;
+
+  e = expr_create(s, strlen(s), &vars, bench_funcs);
+  if (e == NULL) {
+    fprintf(stderr, "expr_bench: %s: syntax error\n", s);
+    return -1;
+  }
+  for (sample = -BENCH_WARMUP; sample < BENCH_SAMPLES; sample++) {
+    bench_jit(0);
+    allocs = bench_allocs;
+    start = bench_now();
+    for (i = 0; i < BENCH_PARSE_OPS; i++) {
+      parsed[i] = expr_create(s, strlen(s), &vars, bench_funcs);
+    }
+    bench_record(&parse, sample, start, allocs, BENCH_PARSE_OPS);
+    bench_jit(1);
+#if JIT
+    allocs = bench_allocs;
+    start = bench_now();
+    for (i = 0; i < BENCH_PARSE_OPS; i++) {
+      parsed[i]->fn = expr_compile(parsed[i], &parsed[i]->jitsz);
+    }
+    bench_record(&jit, sample, start, allocs, BENCH_PARSE_OPS);
+#endif
+    allocs = bench_allocs;
+    start = bench_now();
+    for (i = 0; i < BENCH_PARSE_OPS; i++) {
+      expr_destroy(parsed[i], NULL);
+    }
+    bench_record(&destroy, sample, start, allocs, BENCH_PARSE_OPS);
+  }
+
+#if JIT
+  fn = e->fn;
+  n = bench_calibrate(e);
+  for (sample = -BENCH_WARMUP; sample < BENCH_SAMPLES; sample++) {
+    allocs = bench_allocs;
+    start = bench_now();
+    for (i = 0; i < n; i++) {
+      expr_eval(e);
+    }
+    bench_record(&native, sample, start, allocs, n);
+  }
+  e->fn = NULL;
+#endif
+  n = bench_calibrate(e);
+  for (sample = -BENCH_WARMUP; sample < BENCH_SAMPLES; sample++) {
+    allocs = bench_allocs;
+    start = bench_now();
+    for (i = 0; i < n; i++) {
+      expr_eval(e);
+    }
+    bench_record(&eval, sample, start, allocs, n);
+  }
+#if JIT
+  e->fn = fn;
+#endif
+
+  c = expr_code_create(e);
+  f = expr_flat_create(e);
+  for (sample = -BENCH_WARMUP; c != NULL && sample < BENCH_SAMPLES; sample++) {
+    allocs = bench_allocs;
+    start = bench_now();
+    for (i = 0; i < n; i++) {
+      expr_code_eval(c);
+    }
+    bench_record(&code, sample, start, allocs, n);
+  }
+  for (sample = -BENCH_WARMUP; f != NULL && sample < BENCH_SAMPLES; sample++) {
+    allocs = bench_allocs;
+    start = bench_now();
+    for (i = 0; i < n; i++) {
+      expr_flat_eval(f);
+    }
+    bench_record(&flat, sample, start, allocs, n);
+  }
+  expr_code_destroy(c);
+  expr_flat_destroy(f);
+  expr_destroy(e, &vars);
+
+  bench_report(s, &parse, first);
+#if JIT
+  bench_report(s, &jit, first);
+  bench_report(s, &native, first);
+#endif
+  bench_report(s, &eval, first);
+  if (c != NULL) {
+    bench_report(s, &code, first);
+  }
+  if (f != NULL) {
+    bench_report(s, &flat, first);
+  }
+  bench_report(s, &destroy, first);
+  return 0;
+}
+
+/*
+ * Generates a script of about n tokens: assignments calling macros, and
+ * definitions of the macros every ten statements.
+ */
+static char *bench_script(long n, size_t *len) {
+  char *s = (char *)malloc(n * 4 + 64);
+  long i, tokens = 0;
+  *len = 0;
+  for (i = 0; s != NULL && tokens < n; i++) {
+    if (i % 10 == 0) {
+      *len += sprintf(s + *len, "$(m%ld,$1*2+v%ld)\n", i / 10 % 100, i % 1000);
+      tokens += 12;
+    } else {
+      *len += sprintf(s + *len, "v%ld=v%ld*3+m%ld(v%ld)\n", i % 1000,
+                      i * 7 % 1000, i / 10 % 100, i * 13 % 1000);
+      tokens += 11;
+    }
+  }
+  return s;
+}
+
+/*
+ * Generates a chain of about n tokens like v0+v1*2-v2+..., a single
+ * expression as long as the input.
+ */
+static char *bench_chain(long n, size_t *len) {
+  char *s = (char *)malloc(n * 4 + 64);
+  long i;
+  *len = 0;
+  for (i = 0; s != NULL && i * 4 < n; i++) {
+    *len += sprintf(s + *len, "%sv%ld*2", (i == 0 ? "" : i % 2 ? "-" : "+"),
+                    i % 1000);
+  }
+  return s;
+}
+
+/* Times a generated input of n tokens, per token */
+static int bench_generated(const char *kind, char *(*generate)(long, size_t *),
+                           long n, int *first) {
+  struct bench_stats parse = {"parse", BENCH_SCRIPT_SAMPLES, {0}, 0, 0};
+  struct bench_stats eval = {"eval", BENCH_SCRIPT_SAMPLES, {0}, 0, 0};
+  struct bench_stats destroy = {"destroy", BENCH_SCRIPT_SAMPLES, {0}, 0, 0};
+  struct expr_var_list vars = {0};
+  size_t len, allocs;
+  char *s = generate(n, &len);
+  char name[64];
+  double start;
+  int sample;
+  if (s == NULL) {
+    return -1;
+  }
+  for (sample = -1; sample < BENCH_SCRIPT_SAMPLES; sample++) {
+    struct expr *e;
+    bench_jit(0);
+    allocs = bench_allocs;
+    start = bench_now();
+    e = expr_create(s, len, &vars, bench_funcs);
+    bench_record(&parse, sample, start, allocs, n);
+    bench_jit(1);
+    if (e == NULL) {
+      fprintf(stderr, "expr_bench: %s can't be parsed\n", kind);
+      free(s);
+      return -1;
+    }
+    allocs = bench_allocs;
+    start = bench_now();
+    expr_eval(e);
+    bench_record(&eval, sample, start, allocs, n);
+    allocs = bench_allocs;
+    start = bench_now();
+    expr_destroy(e, NULL);
+    bench_record(&destroy, sample, start, allocs, n);
+  }
+  expr_destroy(NULL, &vars);
+  free(s);
+  snprintf(name, sizeof(name), "%s of %ld tokens", kind, n);
+  bench_report(name, &parse, first);
+  bench_report(name, &eval, first);
+  bench_report(name, &destroy, first);
+  return 0;
+}
+
+/*
+ * Times scripts and operator chains of growing size, per token, to show how
+ * parsing scales.
+ */
+static int bench_scripts(int *first) {
+  long sizes[] = {10000, 100000, 1000000};
+  unsigned int k;
+  for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+    if (bench_generated("script", bench_script, sizes[k], first) == -1) {
+      return -1;
+    }
+  }
+  for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+    if (bench_generated("chain", bench_chain, sizes[k], first) == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  const char **exprs = bench_exprs;
+#if JIT
+  const char *jit = "true";
+#else
+  const char *jit = "false";
+#endif
+  int i, n = sizeof(bench_exprs) / sizeof(bench_exprs[0]);
+  int first = 1, status = 0;
+  if (argc > 1) {
+    exprs = (const char **)(argv + 1);
+    n = argc - 1;
+  }
+  printf("{\n  \"number_type\": \"%s\",\n  \"jit\": %s,\n  \"results\": [",
+         (EXPR_INT64 ? "int64" : sizeof(expr_num_t) == sizeof(float)
+                                     ? "float"
+                                     : "double"),
+         jit);
+  for (i = 0; i < n; i++) {
+    if (bench_expr(exprs[i], &first) == -1) {
+      status = 1;
+    }
+  }
+  if (argc == 1 && bench_scripts(&first) == -1) {
+    status = 1;
+  }
+  printf("\n  ]\n}\n");
+  return status;
+}
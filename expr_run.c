@@ -0,0 +1,316 @@
+/*
+ * expr-run: evaluates an expression for every row of a columnar file.
+ *
+ *   expr-run [-f raw|csv] [-c a,b,...] [-r] [-b] [-t threads] expr file
+ *
+ * CSV files (the default for names ending in .csv) start with a header line
+ * of column names. Other files are raw little-endian floats, all rows of the
+ * first column, then of the second one and so on, or row after row with -r.
+ * Their column names are given with -c. Columns are bound to the variables of
+ * the same name, results are written to stdout one per line, or as raw floats
+ * with -b.
+ *
+ * Input is memory-mapped and processed EXPR_RUN_ROWS rows at a time, so memory
+ * use doesn't depend on the file size. Raw float columns are evaluated right
+ * from the mapping without copying.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "expr.h"
+#include "expr_thread.h"
+
+#ifndef EXPR_RUN_ROWS
+#define EXPR_RUN_ROWS 65536
+#endif
+
+#define EXPR_RUN_MAX_COLUMNS 1024
+
+struct expr_run {
+  const char *base; /* mapped file */
+  size_t size;
+  const char *pos; /* next CSV line */
+  int csv;
+  int rows_layout; /* raw values are stored row after row */
+  size_t nrows;    /* rows in a raw file */
+  int ncols;
+  struct expr_column cols[EXPR_RUN_MAX_COLUMNS];
+  expr_num_t *buf; /* EXPR_RUN_ROWS rows of each column, unless zero-copy */
+};
+
+static void usage(void) {
+  fprintf(stderr, "usage: expr-run [-f raw|csv] [-c a,b,...] [-r] [-b] "
+                  "[-t threads] expr file\n");
+  exit(2);
+}
+
+/* Binds comma-separated names to columns, returns number of columns */
+static int expr_run_names(struct expr_run *r, const char *s, const char *end,
+                          struct expr_var_list *vars) {
+  while (s < end && r->ncols < EXPR_RUN_MAX_COLUMNS) {
+    const char *name = s;
+    const char *stop = s;
+    while (stop < end && *stop != ',') {
+      stop++;
+    }
+    s = stop + 1;
+    while (name < stop && isspace(*name)) {
+      name++;
+    }
+    while (stop > name && isspace(stop[-1])) {
+      stop--;
+    }
+    r->cols[r->ncols].var = expr_var(vars, name, stop - name);
+    if (r->cols[r->ncols].var == NULL) {
+      return -1; /* invalid name */
+    }
+    r->ncols++;
+  }
+  return r->ncols;
+}
+
+static int expr_run_little_endian(void) {
+  uint32_t one = 1;
+  return *(unsigned char *)&one == 1;
+}
+
+/* Parses a CSV field, empty or invalid ones are NaN */
+static expr_num_t expr_run_field(const char *s, size_t len) {
+  char buf[64];
+  char *end;
+  double value;
+  while (len > 0 && isspace(*s)) {
+    s++, len--;
+  }
+  while (len > 0 && isspace(s[len - 1])) {
+    len--;
+  }
+  if (len == 0 || len >= sizeof(buf)) {
+    return EXPR_NAN;
+  }
+  memcpy(buf, s, len);
+  buf[len] = '\0';
+  value = strtod(buf, &end);
+  return (*end == '\0' ? (expr_num_t)value : EXPR_NAN);
+}
+
+/* Points columns at the next rows, returns number of rows or 0 at the end */
+static size_t expr_run_next(struct expr_run *r, size_t row) {
+  size_t n = 0;
+  int k;
+  if (r->csv) {
+    const char *end = r->base + r->size;
+    while (n < EXPR_RUN_ROWS && r->pos < end) {
+      const char *line = r->pos;
+      const char *eol = memchr(line, '\n', end - line);
+      eol = (eol == NULL ? end : eol);
+      r->pos = eol + 1;
+      if (eol > line && eol[-1] == '\r') {
+        eol--;
+      }
+      if (eol == line) {
+        continue; /* blank line */
+      }
+      for (k = 0; k < r->ncols; k++) {
+        const char *stop = line;
+        while (stop < eol && *stop != ',') {
+          stop++;
+        }
+        r->buf[k * EXPR_RUN_ROWS + n] = expr_run_field(line, stop - line);
+        line = (stop < eol ? stop + 1 : eol);
+      }
+      n++;
+    }
+  } else {
+    const float *data = (const float *)r->base;
+    n = r->nrows - row;
+    n = (n > EXPR_RUN_ROWS ? EXPR_RUN_ROWS : n);
+    for (k = 0; k < r->ncols && n > 0; k++) {
+      size_t first = (r->rows_layout ? row * r->ncols + k : k * r->nrows + row);
+      size_t stride = (r->rows_layout ? (size_t)r->ncols : 1);
+      if (r->buf == NULL) {
+        /* Numbers are little-endian floats, used in place */
+        r->cols[k].data = (const expr_num_t *)(const void *)(data + first);
+        r->cols[k].stride = stride;
+      } else {
+        for (size_t i = 0; i < n; i++) {
+          uint32_t bits;
+          float f;
+          memcpy(&bits, data + first + i * stride, sizeof(bits));
+          if (!expr_run_little_endian()) {
+            bits = (bits >> 24) | ((bits >> 8) & 0xff00) |
+                   ((bits << 8) & 0xff0000) | (bits << 24);
+          }
+          memcpy(&f, &bits, sizeof(f));
+          r->buf[k * EXPR_RUN_ROWS + i] = (expr_num_t)f;
+        }
+      }
+    }
+  }
+  for (k = 0; k < r->ncols; k++) {
+    r->cols[k].len = n;
+  }
+  return n;
+}
+
+int main(int argc, char *argv[]) {
+  struct expr_run r;
+  struct expr_var_list vars = {0};
+  struct expr *e;
+  const char *names = NULL;
+  const char *format = NULL;
+  expr_num_t *out, *init;
+  struct expr_var *v;
+  struct stat st;
+  size_t row = 0, n;
+  int c, k, fd, binary = 0, nthreads = 1, nvars = 0, status = 0;
+
+  memset(&r, 0, sizeof(r));
+  while ((c = getopt(argc, argv, "f:c:rbt:")) != -1) {
+    switch (c) {
+    case 'f':
+      format = optarg;
+      break;
+    case 'c':
+      names = optarg;
+      break;
+    case 'r':
+      r.rows_layout = 1;
+      break;
+    case 'b':
+      binary = 1;
+      break;
+    case 't':
+      nthreads = atoi(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (argc - optind != 2) {
+    usage();
+  }
+  if (format == NULL) {
+    size_t len = strlen(argv[optind + 1]);
+    format = (len > 4 && strcmp(argv[optind + 1] + len - 4, ".csv") == 0
+                  ? "csv"
+                  : "raw");
+  }
+  r.csv = (strcmp(format, "csv") == 0);
+  if (!r.csv && strcmp(format, "raw") != 0) {
+    usage();
+  }
+
+  fd = open(argv[optind + 1], O_RDONLY);
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    perror(argv[optind + 1]);
+    return 1;
+  }
+  r.size = (size_t)st.st_size;
+  if (r.size > 0) {
+    r.base = (const char *)mmap(NULL, r.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (r.base == MAP_FAILED) {
+      perror("mmap");
+      return 1;
+    }
+    posix_madvise((void *)r.base, r.size, POSIX_MADV_SEQUENTIAL);
+  }
+  close(fd);
+
+  if (r.csv) {
+    const char *end = r.base + r.size;
+    const char *eol = (r.size > 0 ? memchr(r.base, '\n', r.size) : NULL);
+    eol = (eol == NULL ? end : eol);
+    r.pos = (eol < end ? eol + 1 : end);
+    if (eol > r.base && eol[-1] == '\r') {
+      eol--;
+    }
+    k = expr_run_names(&r, r.base, eol, &vars);
+  } else {
+    k = (names != NULL ? expr_run_names(&r, names, names + strlen(names), &vars)
+                       : 0);
+  }
+  if (k <= 0) {
+    fprintf(stderr, "expr-run: no valid column names\n");
+    return 1;
+  }
+  if (!r.csv) {
+    if (r.size % (sizeof(float) * r.ncols) != 0) {
+      fprintf(stderr, "expr-run: file size is not a multiple of %d floats\n",
+              r.ncols);
+      return 1;
+    }
+    r.nrows = r.size / (sizeof(float) * r.ncols);
+  }
+  /* Only float columns of a little-endian machine can be used in place */
+  if (r.csv || sizeof(expr_num_t) != sizeof(float) || EXPR_INT64 ||
+      !expr_run_little_endian()) {
+    r.buf = (expr_num_t *)malloc(r.ncols * EXPR_RUN_ROWS * sizeof(expr_num_t));
+    if (r.buf == NULL) {
+      fprintf(stderr, "expr-run: out of memory\n");
+      return 1;
+    }
+    for (k = 0; k < r.ncols; k++) {
+      r.cols[k].data = r.buf + k * EXPR_RUN_ROWS;
+      r.cols[k].stride = 1;
+    }
+  }
+
+  e = expr_create(argv[optind], strlen(argv[optind]), &vars, NULL);
+  if (e == NULL) {
+    fprintf(stderr, "expr-run: syntax error\n");
+    return 1;
+  }
+  expr_optimize(e, EXPR_OPT_FOLD);
+  for (v = vars.head; v; v = v->next) {
+    nvars++;
+  }
+  out = (expr_num_t *)malloc(EXPR_RUN_ROWS * sizeof(expr_num_t));
+  init = (expr_num_t *)malloc((nvars + 1) * sizeof(expr_num_t));
+  if (out == NULL || init == NULL) {
+    fprintf(stderr, "expr-run: out of memory\n");
+    return 1;
+  }
+  for (k = 0, v = vars.head; v; v = v->next) {
+    init[k++] = v->value;
+  }
+  while ((n = expr_run_next(&r, row)) > 0) {
+    if (expr_eval_batch_mt(e, r.cols, r.ncols, out, n, nthreads) == -1) {
+      fprintf(stderr, "expr-run: evaluation failed\n");
+      status = 1;
+      break;
+    }
+    if (binary) {
+      for (size_t i = 0; i < n; i++) {
+        float f = (float)out[i];
+        fwrite(&f, sizeof(f), 1, stdout);
+      }
+    } else {
+      for (size_t i = 0; i < n; i++) {
+        printf("%.9g\n", (double)out[i]);
+      }
+    }
+    /* Every row starts with the same variables, as in one batch */
+    for (k = 0, v = vars.head; v; v = v->next) {
+      v->value = init[k++];
+    }
+    row += n;
+  }
+  if (fflush(stdout) != 0) {
+    perror("expr-run");
+    status = 1;
+  }
+  free(out);
+  free(init);
+  free(r.buf);
+  expr_destroy(e, &vars);
+  if (r.size > 0) {
+    munmap((void *)r.base, r.size);
+  }
+  return status;
+}
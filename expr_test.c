@@ -1,4 +1,9 @@
+#if JIT
+#include "expr_jit.c"
+#else
 #include "expr.h"
+#endif
+#include "expr_thread.h"
 
 #if 0
 /* This can be useful for debugging */
@@ -7,7 +12,6 @@
 
 #include <assert.h>
 #include <stdio.h>
-#include <sys/time.h>
 
 int status = 0;
 
@@ -53,7 +57,27 @@ static void test_vars() {
   struct expr_var *again = expr_var(&vars, "a", 1);
   assert(again == a);
   assert(again->value == 4);
+  assert(expr_var_of(&a->value) == a);
+
+  /* Long lists are indexed, also after adding variables to the list */
+  char name[16];
+  for (int i = 0; i < 1000; i++) {
+    snprintf(name, sizeof(name), "v%d", i);
+    expr_var(&vars, name, strlen(name))->value = i;
+  }
+  struct expr_var *extra = (struct expr_var *)calloc(1, sizeof(*extra) + 2);
+  strcpy(extra->name, "w");
+  extra->next = vars.head;
+  vars.head = extra;
+  assert(expr_var(&vars, "w", 1) == extra);
+  for (int i = 999; i >= 0; i--) {
+    snprintf(name, sizeof(name), "v%d", i);
+    assert(expr_var(&vars, name, strlen(name))->value == i);
+  }
+  assert(expr_var(&vars, "a", 1) == a);
+  assert(expr_var(&vars, "v", 1)->value == 0);
   expr_destroy(NULL, &vars);
+  assert(vars.head == NULL);
 }
 
 /*
@@ -114,7 +138,8 @@ static void user_func_nop_cleanup(struct expr_func *f, void *c) {
   struct nop_context *nop = (struct nop_context *)c;
   free(nop->p);
 }
-static float user_func_nop(struct expr_func *f, vec_expr_t *args, void *c) {
+static expr_num_t user_func_nop(struct expr_func *f, vec_expr_t *args,
+                                void *c) {
   (void)args;
   struct nop_context *nop = (struct nop_context *)c;
   if (f->ctxsz == 0) {
@@ -127,38 +152,56 @@ static float user_func_nop(struct expr_func *f, vec_expr_t *args, void *c) {
   return 0;
 }
 
-static float user_func_add(struct expr_func *f, vec_expr_t *args, void *c) {
+static expr_num_t user_func_add(struct expr_func *f, vec_expr_t *args,
+                                void *c) {
   (void)f, (void)c;
-  float a = expr_eval(&vec_nth(args, 0));
-  float b = expr_eval(&vec_nth(args, 1));
+  expr_num_t a = expr_eval(&vec_nth(args, 0));
+  expr_num_t b = expr_eval(&vec_nth(args, 1));
   return a + b;
 }
 
-static float user_func_next(struct expr_func *f, vec_expr_t *args, void *c) {
+static expr_num_t user_func_next(struct expr_func *f, vec_expr_t *args,
+                                 void *c) {
   (void)f, (void)c;
-  float a = expr_eval(&vec_nth(args, 0));
+  expr_num_t a = expr_eval(&vec_nth(args, 0));
   return a + 1;
 }
 
-static float user_func_print(struct expr_func *f, vec_expr_t *args, void *c) {
+static expr_num_t user_func_print(struct expr_func *f, vec_expr_t *args,
+                                  void *c) {
   (void)f, (void)c;
   int i;
   struct expr e;
   fprintf(stderr, ">> ");
-  vec_foreach(args, e, i) { fprintf(stderr, "%f ", expr_eval(&e)); }
+  vec_foreach(args, e, i) { fprintf(stderr, "%f ", (double)expr_eval(&e)); }
   fprintf(stderr, "\n");
   return 0;
 }
 
+/* Thread-safe, but not pure: counts the calls */
+static pthread_mutex_t user_count_lock = PTHREAD_MUTEX_INITIALIZER;
+static long user_count_calls;
+
+static expr_num_t user_func_count(struct expr_func *f, vec_expr_t *args,
+                                  void *c) {
+  (void)f, (void)c;
+  pthread_mutex_lock(&user_count_lock);
+  user_count_calls++;
+  pthread_mutex_unlock(&user_count_lock);
+  return expr_eval(&vec_nth(args, 0));
+}
+
 static struct expr_func user_funcs[] = {
-    {"nop", user_func_nop, user_func_nop_cleanup, sizeof(struct nop_context)},
-    {"add", user_func_add, NULL, 0},
-    {"next", user_func_next, NULL, 0},
-    {"print", user_func_print, NULL, 0},
-    {NULL, NULL, NULL, 0},
+    {"nop", user_func_nop, user_func_nop_cleanup, sizeof(struct nop_context),
+     0, 0},
+    {"add", user_func_add, NULL, 0, 1, 0},
+    {"next", user_func_next, NULL, 0, 1, 0},
+    {"print", user_func_print, NULL, 0, 0, 0},
+    {"count", user_func_count, NULL, 0, 0, 1},
+    {NULL, NULL, NULL, 0, 0, 0},
 };
 
-static void test_expr(char *s, float expected) {
+static void test_expr(char *s, expr_num_t expected) {
   struct expr_var_list vars = {0};
   struct expr *e = expr_create(s, strlen(s), &vars, user_funcs);
   if (e == NULL) {
@@ -166,7 +209,63 @@ static void test_expr(char *s, float expected) {
     status = 1;
     return;
   }
-  float result = expr_eval(e);
+  expr_num_t result = expr_eval(e);
+
+  struct expr_code *c = expr_code_create(e);
+  if (c == NULL) {
+    printf("FAIL: %s can't be compiled to bytecode\n", s);
+    status = 1;
+  } else {
+    expr_num_t code_result = expr_code_eval(c);
+    if (!(expr_isnan(result) && expr_isnan(code_result)) &&
+        code_result != result) {
+      printf("FAIL: %s: bytecode %f != %f\n", s, (double)code_result,
+             (double)result);
+      status = 1;
+    }
+    expr_code_destroy(c);
+  }
+
+  struct expr_flat *flat = expr_flat_create(e);
+  if (flat == NULL) {
+    printf("FAIL: %s can't be flattened\n", s);
+    status = 1;
+  } else {
+    expr_num_t flat_result = expr_flat_eval(flat);
+    if (!(expr_isnan(result) && expr_isnan(flat_result)) &&
+        flat_result != result) {
+      printf("FAIL: %s: flat %f != %f\n", s, (double)flat_result,
+             (double)result);
+      status = 1;
+    }
+    expr_flat_destroy(flat);
+  }
+
+  struct expr_var_list folded_vars = {0};
+  struct expr *folded = expr_create(s, strlen(s), &folded_vars, user_funcs);
+  expr_optimize(folded, EXPR_OPT_FOLD);
+  expr_num_t folded_result = expr_eval(folded);
+  if (!(expr_isnan(result) && expr_isnan(folded_result)) &&
+      folded_result != result) {
+    printf("FAIL: %s: folded %f != %f\n", s, (double)folded_result,
+             (double)result);
+    status = 1;
+  }
+  expr_destroy(folded, &folded_vars);
+
+  struct expr_arena arena = {0};
+  struct expr_var_list arena_vars = {0};
+  struct expr *a =
+      expr_create_arena(s, strlen(s), &arena_vars, user_funcs, &arena);
+  expr_num_t arena_result = (a == NULL ? EXPR_NAN : expr_eval(a));
+  if (!(expr_isnan(result) && expr_isnan(arena_result)) &&
+      arena_result != result) {
+    printf("FAIL: %s: arena %f != %f\n", s, (double)arena_result,
+             (double)result);
+    status = 1;
+  }
+  expr_arena_free(&arena);
+  expr_destroy(NULL, &arena_vars);
 
   char *p = (char *)malloc(strlen(s) + 1);
   strncpy(p, s, strlen(s) + 1);
@@ -176,12 +275,12 @@ static void test_expr(char *s, float expected) {
     }
   }
 
-  if ((isnan(result) && !isnan(expected)) ||
-      fabs(result - expected) > 0.00001f) {
-    printf("FAIL: %s: %f != %f\n", p, result, expected);
+  if ((expr_isnan(result) && !expr_isnan(expected)) ||
+      fabs((double)result - (double)expected) > 0.00001f) {
+    printf("FAIL: %s: %f != %f\n", p, (double)result, (double)expected);
     status = 1;
   } else {
-    printf("OK: %s == %f\n", p, expected);
+    printf("OK: %s == %f\n", p, (double)expected);
   }
   expr_destroy(e, &vars);
   free(p);
@@ -195,6 +294,16 @@ static void test_expr_error(char *s) {
     status = 1;
   }
   expr_destroy(e, &vars);
+
+  struct expr_arena arena = {0};
+  struct expr_var_list arena_vars = {0};
+  if (expr_create_arena(s, strlen(s), &arena_vars, user_funcs, &arena) !=
+      NULL) {
+    printf("FAIL: %s should return error in arena\n", s);
+    status = 1;
+  }
+  expr_arena_free(&arena);
+  expr_destroy(NULL, &arena_vars);
 }
 
 static void test_empty() {
@@ -207,7 +316,9 @@ static void test_const() {
   test_expr("1", 1);
   test_expr(" 1 ", 1);
   test_expr("12", 12);
+#if !EXPR_INT64
   test_expr("12.3", 12.3);
+#endif
 }
 
 static void test_unary() {
@@ -216,6 +327,9 @@ static void test_unary() {
   test_expr("!0 ", !0);
   test_expr("!2 ", !2);
   test_expr("^3", ~3);
+  test_expr("^1.7", ~1);
+  test_expr("^-1.7", ~-1);
+  test_expr("^(3%0)", ~0);
 }
 
 static void test_binary() {
@@ -224,18 +338,34 @@ static void test_binary() {
   test_expr("2*3", 2 * 3);
   test_expr("2+3*4", 2 + 3 * 4);
   test_expr("2*3+4", 2 * 3 + 4);
+#if !EXPR_INT64
   test_expr("2+3/2", 2 + 3.0 / 2.0);
   test_expr("1/3*6/4*2", 1.0 / 3 * 6 / 4.0 * 2);
   test_expr("1*3/6*4/2", 1.0 * 3 / 6 * 4.0 / 2.0);
+#endif
   test_expr("6/2+8*4/2", 19);
+#if !EXPR_INT64
   test_expr("3/2", 3.0 / 2.0);
+#endif
   test_expr("(3/2)|0", 3 / 2);
+#if !EXPR_INT64
   test_expr("(3/0)", INFINITY);
   test_expr("(3/0)|0", INT_MAX);
   test_expr("(3%0)", NAN);
+#endif
   test_expr("(3%0)|0", 0);
+#if !EXPR_INT64
+  test_expr("(-3/0)|0", -INT_MAX);
+  test_expr("10000000000|0", INT_MIN);
+  test_expr("-3000000000|0", INT_MIN);
+  test_expr("1<<33", 2);
+  test_expr("-1<<31", INT_MIN);
+  test_expr("-8>>-1", -1);
+#endif
   test_expr("2**3", 8);
+#if !EXPR_INT64
   test_expr("9**(1/2)", 3);
+#endif
   test_expr("1+2<<3", (1 + 2) << 3);
   test_expr("2<<3", 2 << 3);
   test_expr("12>>2", 12 >> 2);
@@ -248,7 +378,9 @@ static void test_binary() {
   test_expr("1==2", 1 == 2);
   test_expr("2==2", 2 == 2);
   test_expr("3==2", 3 == 2);
+#if !EXPR_INT64
   test_expr("3.2==3.1", 3.2f == 3.1f);
+#endif
   test_expr("1<=2", 1 <= 2);
   test_expr("2<=2", 2 <= 2);
   test_expr("3<=2", 3 <= 2);
@@ -257,11 +389,33 @@ static void test_binary() {
   test_expr("3>=2", 3 >= 2);
   test_expr("123&42", 123 & 42);
   test_expr("123^42", 123 ^ 42);
+  /* Bitwise subtrees are not rounded to float between the nodes */
+  test_expr("((1<<24)|1)&1", 1);
+  test_expr("(^((1<<30)|5))&7", 2);
 
   test_expr("1-1+1+1", 1 - 1 + 1 + 1);
   test_expr("2**2**3", 256); /* 2^(2^3), not (2^2)^3 */
 }
 
+static void test_int64() {
+#if EXPR_INT64
+  test_expr("7/2", 3);
+  test_expr("-7/2", -3);
+  test_expr("7%-3", 1);
+  test_expr("12.7", 12);
+  test_expr("3/0", 0);
+  test_expr("3%0", 0);
+  test_expr("3**-1", 0);
+  test_expr("2**62", 4611686018427387904LL);
+  test_expr("1<<63", -9223372036854775807LL - 1);
+  test_expr("1<<64", 1);
+  test_expr("(1<<63)-1", 9223372036854775807LL);
+  test_expr("x=1<<63, x/-1", -9223372036854775807LL - 1);
+  test_expr("^(1<<40)", ~(1LL << 40));
+  test_expr("99999999999999999999999", 200376420520689663LL);
+#endif
+}
+
 static void test_logical() {
   test_expr("2&&3", 3);
   test_expr("0&&3", 0);
@@ -271,8 +425,10 @@ static void test_logical() {
   test_expr("2||0", 2);
   test_expr("0||0", 0);
 
+#if !EXPR_INT64
   test_expr("1&&(3%0)", NAN);
   test_expr("(3%0)&&1", NAN);
+#endif
   test_expr("1||(3%0)", 1);
   test_expr("(3%0)||1", 1);
 }
@@ -280,15 +436,31 @@ static void test_logical() {
 static void test_parens() {
   test_expr("(1+2)*3", (1 + 2) * 3);
   test_expr("(1)", 1);
+#if !EXPR_INT64
   test_expr("(2.4)", 2.4);
+#endif
   test_expr("((2))", 2);
   test_expr("(((3)))", 3);
   test_expr("(((3)))*(1+(2))", 9);
 }
 
 static void test_assign() {
+  char s[1024];
+  int len = sprintf(s, "x=0, ");
+  expr_num_t expected;
   test_expr("x=5", 5);
   test_expr("x=y=3", 3);
+  /* Left operands are assigned first, deeper than there are registers too */
+  for (int i = 0; i < 20; i++) {
+    len += sprintf(s + len, "(x=x*2+1)-(");
+  }
+  len += sprintf(s + len, "x");
+  expected = (1 << 20) - 1;
+  for (int i = 20; i > 0; i--) {
+    expected = ((1 << i) - 1) - expected;
+    len += sprintf(s + len, ")");
+  }
+  test_expr(s, expected);
 }
 
 static void test_comma() {
@@ -301,6 +473,8 @@ static void test_comma() {
 }
 
 static void test_funcs() {
+  char macros[2048];
+  int n = 0;
   test_expr("add(1,2) + next(3)", 7);
   test_expr("add(1,next(2))", 4);
   test_expr("add(1,1+1) + add(2*2+1,2)", 10);
@@ -310,8 +484,781 @@ static void test_funcs() {
   test_expr("$(zero), zero(1, 2, 3)", 0);
   test_expr("$(one, 1), one()+one(1)+one(1, 2, 4)", 3);
   test_expr("$(number, 1), $(number, 2+3), number()", 5);
+#if !EXPR_INT64
   test_expr("$(triw, ($1 * 256) & 255), triw(0.5, 2)", 128);
   test_expr("$(triw, ($1 * 256) & 255), triw(0.1)+triw(0.7)+triw(0.2)", 255);
+#endif
+  test_expr("$(sqr, $1*$1), sqr(sqr(2)+1)", 25);
+  test_expr("$(sum, $1+$2+$3), sum(1, sum(2, 3, 4), 5)", 15);
+  test_expr("$(sum, $1+$2), sum(3)", 3);
+  test_expr("$(inc, $1+1), $1=5, inc(2)+$1", 8);
+  test_expr("$(g, 2), $(g, g()*3), g()", 6);
+  test_expr("$(inc, x=x+$1, x*2), x=1, inc(2)+inc(1)", 14);
+  for (int i = 0; i < 100; i++) {
+    n += snprintf(macros + n, sizeof(macros) - n, "$(m%d, %d), ", i, i);
+  }
+  snprintf(macros + n, sizeof(macros) - n, "$(m42, -1), m42()+m99()");
+  test_expr(macros, 98);
+}
+
+static void test_registry() {
+  struct expr_func funcs[] = {
+      {"add", user_func_add, NULL, 0, 1, 0},
+      {"next", user_func_next, NULL, 0, 1, 0},
+      {"next", user_func_add, NULL, 0, 1, 0},
+      {"nop", user_func_nop, user_func_nop_cleanup, sizeof(struct nop_context),
+       0, 0},
+      {NULL, NULL, NULL, 0, 0, 0},
+  };
+  struct expr_func_registry r;
+  struct expr_var_list vars = {0};
+  const char *s = "x=2, nop(), add(next(x), add(1, next(0)))";
+  assert(expr_func_registry_init(&r, funcs) == 0);
+  assert(expr_func_lookup(&r, "next", 4) == &funcs[1]);
+  assert(expr_func_lookup(&r, "nop", 3) == &funcs[3]);
+  assert(expr_func_lookup(&r, "ad", 2) == NULL);
+  assert(expr_func_lookup(&r, "adds", 4) == NULL);
+  struct expr *e = expr_create_ex(s, strlen(s), &vars, &r, NULL);
+  if (e == NULL || expr_eval(e) != 5) {
+    printf("FAIL: %s: registry\n", s);
+    status = 1;
+  }
+  expr_destroy(e, &vars);
+  s = "sub(1, 2)";
+  if (expr_create_ex(s, strlen(s), &vars, &r, NULL) != NULL) {
+    printf("FAIL: %s should return error\n", s);
+    status = 1;
+  }
+  expr_destroy(NULL, &vars);
+  expr_func_registry_free(&r);
+}
+
+static void test_cache() {
+  struct expr_cache c;
+  struct expr_func_registry r = {user_funcs, NULL, 0};
+  struct expr_var_list vars = {0};
+  struct expr_var_list other_vars = {0};
+  assert(expr_cache_init(&c, 2) == 0);
+
+  struct expr_cache_entry *a = expr_cache_get(&c, "x+1", 3, &vars, &r);
+  struct expr_cache_entry *b = expr_cache_get(&c, "x+1", 3, &vars, &r);
+  struct expr_cache_entry *other = expr_cache_get(&c, "x+1", 3, &other_vars, &r);
+  assert(a != NULL && a == b && a->refs == 2 && other != a);
+  assert(expr_cache_get(&c, "x+", 2, &vars, &r) == NULL);
+  assert(c.hits == 1 && c.misses == 3 && c.evictions == 0);
+  expr_var(&vars, "x", 1)->value = 2;
+  assert(expr_eval(a->e) == 3);
+  expr_cache_put(&c, b);
+  expr_cache_put(&c, other);
+
+  /* Cache is full, "x+1" is referenced and can't be evicted */
+  b = expr_cache_get(&c, "x*2", 3, &vars, &r);
+  assert(c.evictions == 1 && b->slot != -1 && expr_eval(b->e) == 4);
+  struct expr_cache_entry *d = expr_cache_get(&c, "x*3", 3, &vars, &r);
+  assert(d->slot == -1 && expr_eval(d->e) == 6);
+  expr_cache_put(&c, d);
+  expr_cache_put(&c, a);
+  expr_cache_put(&c, b);
+
+  d = expr_cache_get(&c, "x*3", 3, &vars, &r);
+  assert(d->slot != -1 && c.evictions == 2 && c.misses == 6);
+  expr_cache_put(&c, d);
+
+  /* NULL is an empty registry, and a key of its own */
+  a = expr_cache_get(&c, "x*3", 3, &vars, NULL);
+  b = expr_cache_get(&c, "x*3", 3, &vars, NULL);
+  assert(a != NULL && a == b && a != d && expr_eval(a->e) == 6);
+  assert(expr_cache_get(&c, "add(x, 1)", 9, &vars, NULL) == NULL);
+  assert(c.hits == 2 && c.misses == 8);
+  expr_cache_put(&c, a);
+  expr_cache_put(&c, b);
+  expr_cache_free(&c);
+  expr_destroy(NULL, &vars);
+  expr_destroy(NULL, &other_vars);
+  printf("OK: cache\n");
+}
+
+static void test_frames() {
+  const char *s = "a=x*2, a+y+x";
+  struct expr_var_list vars = {0};
+  struct expr *e = expr_create(s, strlen(s), &vars, user_funcs);
+  struct expr_flat *f = expr_flat_create(e);
+  struct expr_var *x = expr_var(&vars, "x", 1);
+  int sx = expr_flat_slot(f, &x->value);
+  int sy = expr_flat_slot(f, &expr_var(&vars, "y", 1)->value);
+  int sa = expr_flat_slot(f, &expr_var(&vars, "a", 1)->value);
+  assert(vec_len(&f->vars) == 3 && sx != -1 && sy != -1 && sa != -1);
+  assert(expr_flat_slot(f, &expr_var(&vars, "z", 1)->value) == -1);
+  for (int i = 0; i < 4; i++) {
+    expr_num_t slots[3] = {0};
+    slots[sx] = i;
+    slots[sy] = 10;
+    if (expr_flat_eval_frame(f, slots) != i * 3 + 10 || slots[sa] != i * 2) {
+      printf("FAIL: %s: frame %d\n", s, i);
+      status = 1;
+    }
+  }
+  assert(x->value == 0 && expr_var(&vars, "a", 1)->value == 0);
+  printf("OK: %s frames\n", s);
+  expr_flat_destroy(f);
+  expr_destroy(e, &vars);
+
+  /* Macro parameters are inlined into slots of the frame */
+  s = "$(sq, $1*$1), $(f, sq($1)+sq($2)), f(x, 2)*sq(f(2, x))";
+  e = expr_create(s, strlen(s), &vars, user_funcs);
+  f = expr_flat_create(e);
+  assert(f != NULL && vec_len(&f->funcs) == 0);
+  x = expr_var(&vars, "x", 1);
+  sx = expr_flat_slot(f, &x->value);
+  for (int i = 0; i < 4; i++) {
+    expr_num_t slots[32] = {0};
+    assert(vec_len(&f->vars) <= 32);
+    slots[sx] = i;
+    x->value = i;
+    if (expr_flat_eval_frame(f, slots) != expr_eval(e)) {
+      printf("FAIL: %s: frame %d\n", s, i);
+      status = 1;
+    }
+  }
+  expr_flat_destroy(f);
+  expr_destroy(e, &vars);
+
+  /* Arguments of pure and thread-safe calls are read from the frame too */
+  s = "add(x, next(x))*count(x)+nop()";
+  e = expr_create(s, strlen(s), &vars, user_funcs);
+  f = expr_flat_create(e);
+  assert(f != NULL && vec_len(&f->funcs) == 4);
+  assert(vec_nth(&f->funcs, 3).args == -1);
+  x = expr_var(&vars, "x", 1);
+  x->value = -1;
+  sx = expr_flat_slot(f, &x->value);
+  for (int i = 0; i < 4; i++) {
+    expr_num_t slots[1];
+    slots[sx] = i;
+    if (expr_flat_eval_frame(f, slots) != (2 * i + 1) * i) {
+      printf("FAIL: %s: frame %d\n", s, i);
+      status = 1;
+    }
+  }
+  assert(x->value == -1);
+  expr_flat_destroy(f);
+  expr_destroy(e, &vars);
+
+  /* Slots of many variables are found through the index */
+  {
+    static char buf[16384];
+    int n = 0;
+    for (int i = 0; i < 1000; i++) {
+      n += sprintf(buf + n, "%sv%d", i > 0 ? "*" : "", i);
+    }
+    e = expr_create(buf, n, &vars, user_funcs);
+    f = expr_flat_create(e);
+    assert(f != NULL);
+    for (int i = 0; i < 1000; i++) {
+      char name[8];
+      expr_num_t *value;
+      int slot;
+      sprintf(name, "v%d", i);
+      value = &expr_var(&vars, name, strlen(name))->value;
+      slot = expr_flat_slot(f, value);
+      if (slot == -1 || vec_nth(&f->vars, slot) != value) {
+        printf("FAIL: slot of %s\n", name);
+        status = 1;
+      }
+    }
+    printf("OK: slots of 1000 variables\n");
+    expr_flat_destroy(f);
+    expr_destroy(e, &vars);
+  }
+}
+
+static void test_optimize(char *s, enum expr_type type, expr_num_t expected) {
+  struct expr_var_list vars = {0};
+  struct expr *e = expr_create(s, strlen(s), &vars, user_funcs);
+  expr_var(&vars, "x", 1)->value = 3;
+  expr_optimize(e, EXPR_OPT_ALL);
+  expr_num_t result = expr_eval(e);
+  if (e->type != type || fabs((double)(result - expected)) > 0.00001f) {
+    printf("FAIL: %s: optimized to %d (%f), expected %d (%f)\n", s, e->type,
+           (double)result, type, (double)expected);
+    status = 1;
+  } else {
+    printf("OK: %s optimized\n", s);
+  }
+  expr_destroy(e, &vars);
+
+  struct expr_arena arena = {0};
+  struct expr_var_list arena_vars = {0};
+  e = expr_create_arena(s, strlen(s), &arena_vars, user_funcs, &arena);
+  expr_var(&arena_vars, "x", 1)->value = 3;
+  expr_optimize(e, EXPR_OPT_ALL);
+  if (e->type != type || fabs((double)(expr_eval(e) - expected)) > 0.00001f) {
+    printf("FAIL: %s: optimized in arena to %d\n", s, e->type);
+    status = 1;
+  }
+  expr_arena_free(&arena);
+  expr_destroy(NULL, &arena_vars);
+}
+
+static void test_optimizations() {
+  test_optimize("5+5+5+5+5+5+5+5+5+5", OP_CONST, 50);
+  test_optimize("((5+5)+(5+5))+((5+5)+(5+5))+(5+5)", OP_CONST, 50);
+  test_optimize("1, 2, x", OP_VAR, 3);
+  test_optimize("x*1", OP_VAR, 3);
+  test_optimize("1*x", OP_VAR, 3);
+  test_optimize("x+0", OP_VAR, 3);
+  test_optimize("(2-2)+x", OP_VAR, 3);
+  test_optimize("x-0", OP_VAR, 3);
+  test_optimize("x/1", OP_VAR, 3);
+  test_optimize("x**1", OP_VAR, 3);
+  test_optimize("x**2", OP_MULTIPLY, 9);
+  test_optimize("(x+1)**2", OP_POWER, 16); /* base is not a variable */
+#if !EXPR_INT64
+  test_optimize("x/4", OP_MULTIPLY, 0.75);
+#endif
+  test_optimize("x/3", OP_DIVIDE, 1);
+  test_optimize("(x+0)**(3-1)", OP_MULTIPLY, 9);
+  test_optimize("((1<<24)|1)&1", OP_CONST, 1);
+  test_optimize("x=2*3", OP_ASSIGN, 6);
+  test_optimize("add(1+2, x*1)", OP_FUNC, 6);
+  test_optimize("add(1+2, 3)", OP_CONST, 6);
+  test_optimize("$(sqr, $1*$1), sqr(2+1)", OP_CONST, 9);
+  test_optimize("$(sqr, $1*$1), sqr(x)", OP_FUNC, 9);
+}
+
+static void test_cse(char *s, int expected_shared) {
+  struct expr_var_list vars = {0};
+  struct expr_var_list ref_vars = {0};
+  struct expr *e = expr_create(s, strlen(s), &vars, user_funcs);
+  struct expr *ref = expr_create(s, strlen(s), &ref_vars, user_funcs);
+  expr_var(&vars, "x", 1)->value = expr_var(&ref_vars, "x", 1)->value = 3;
+  expr_var(&vars, "y", 1)->value = expr_var(&ref_vars, "y", 1)->value = 4;
+  int before = expr_count(e);
+  int shared = expr_cse(e, &vars);
+  expr_num_t result = expr_eval(e);
+  expr_num_t expected = expr_eval(ref);
+  struct expr_code *code = expr_code_create(e);
+  expr_var(&vars, "x", 1)->value = 3;
+  if (shared != expected_shared || result != expected || code == NULL ||
+      expr_code_eval(code) != expected ||
+      expr_var(&vars, "x", 1)->value != expr_var(&ref_vars, "x", 1)->value) {
+    printf("FAIL: %s: %d shared (expected %d), %f != %f\n", s, shared,
+           expected_shared, (double)result, (double)expected);
+    status = 1;
+  } else {
+    printf("OK: %s: %d -> %d nodes\n", s, before, expr_count(e));
+  }
+  expr_code_destroy(code);
+  expr_destroy(e, &vars);
+  expr_destroy(ref, &ref_vars);
+}
+
+static void test_cses() {
+  test_cse("x*y", 0);
+  test_cse("(x*y+2)*(x*y+2)+(x*y+2)/(x*y+2)", 1);
+  test_cse("(x*y+2)*(x*y+2)+x*y*3+x*y", 2);
+  test_cse("(x*y)&&(x*y+1)||(x*y+1)", 1);
+  test_cse("next(x)*next(x)+next(x)", 1);
+  test_cse("nop(x*y+2)+nop(x*y+2)", 1);
+  test_cse("$(sqr, $1*$1), sqr(x+y)/sqr(x+y)", 1);
+  test_cse("$(inc, x=x+$1), inc(y*2)+inc(y*2)", 0);
+  test_cse("$(inc, x=x+1), (x*y+2) + inc() + (x*y+2)*(x*y+2)", 0);
+  test_cse("$(inc, x=x+1), $(twice, inc(), inc()), (x*y+2) + twice() + "
+           "(x*y+2)*(x*y+2)",
+           0);
+  test_cse("x=x+1, (x*y+2)*(x*y+2)", 0);
+  test_cse("(y*y+2)*(y*y+2), x=y*y+2", 1);
+  test_cse("(x*y+2)**2", 1);
+  test_cse("(x+1)**2/(x+1)**2", 2);
+  test_cse("$(sqr, $1*$1), sqr(x+y)**2", 1);
+  test_cse("next(x)**2", 1);
+  test_cse("nop(x)**2", 0);
+  test_cse("x=x+1, (x*y)**2", 0);
+#if EXPR_INT64
+  test_cse("((x<<4)|y)+((x<<4)|y)", 1);
+#else
+  test_cse("((x<<4)|y)+((x<<4)|y)", 0);
+#endif
+}
+
+static void test_incremental(char *s) {
+  struct expr_var_list vars = {0};
+  struct expr_var_list ref_vars = {0};
+  struct expr *e = expr_create(s, strlen(s), &vars, user_funcs);
+  struct expr *ref = expr_create(s, strlen(s), &ref_vars, user_funcs);
+  struct expr_incr *c = expr_incr_create(e);
+  const char *names[] = {"a", "b", "c", "x"};
+  int i, recomputed = 0;
+  assert(c != NULL);
+  for (i = 0; i < 100; i++) {
+    /* Usually a single variable changes */
+    const char *name = names[i % 4];
+    expr_num_t value = (expr_num_t)(i % 7 + (i % 13 == 0 ? 9 : 0));
+    expr_var(&vars, name, 1)->value = value;
+    expr_var(&ref_vars, name, 1)->value = value;
+    expr_num_t result = expr_eval_incremental(c);
+    expr_num_t expected = expr_eval(ref);
+    if (!(expr_isnan(result) && expr_isnan(expected)) && result != expected) {
+      printf("FAIL: %s: step %d: %f != %f\n", s, i, (double)result,
+             (double)expected);
+      status = 1;
+      break;
+    }
+    recomputed += (i > 0 ? c->recomputed : 0);
+  }
+  printf("OK: %s: %d nodes, %.1f recomputed\n", s, vec_len(&c->nodes),
+         recomputed / 99.0);
+  expr_incr_destroy(c);
+  expr_destroy(e, &vars);
+  expr_destroy(ref, &ref_vars);
+}
+
+static void test_incrementals() {
+  test_incremental("(a*a+1)*(b+2)-(c/3+4)*(c-1)");
+  test_incremental("a>b && (c+1)*2 || ((a<<3)|b)&(c^7)");
+  test_incremental("y=y+1, (a+b)*(c+y)");
+  test_incremental("add(a*2, b)-nop()+next(c*c)");
+  test_incremental("$(sqr, $1*$1), sqr(a)+sqr(b)+c");
+  test_incremental("$(inc, c=c+1), (a*c+2) + inc() + (a*c+2)*b");
+}
+
+static void test_incremental_uses() {
+  struct expr_var_list vars = {0};
+  const char *s = "(a+b)*(c+d)+(a-b)";
+  struct expr *e = expr_create(s, strlen(s), &vars, user_funcs);
+  struct expr_incr *c = expr_incr_create(e);
+  expr_var(&vars, "a", 1)->value = 1;
+  expr_var(&vars, "b", 1)->value = 2;
+  assert(expr_eval_incremental(c) == -1 && c->recomputed == 11);
+  assert(expr_eval_incremental(c) == -1 && c->recomputed == 0);
+  expr_var(&vars, "c", 1)->value = 3;
+  /* c, c+d, the product and the sum */
+  assert(expr_eval_incremental(c) == 8 && c->recomputed == 4);
+  expr_incr_destroy(c);
+  expr_destroy(e, &vars);
+}
+
+static void test_program() {
+  const char *rules[] = {
+      "a*b+c",         "(a*b+c)*2",   "x=a*b",
+      "x+1",           "add(a*b, c)", "(a*b+c)*(a*b+c)>10 && c",
+      "$(sqr, $1*$1), sqr(a*b+c)",    "next(c)-next(c)",
+  };
+  int n = sizeof(rules) / sizeof(rules[0]);
+  struct expr_var_list vars = {0};
+  struct expr_var_list ref_vars = {0};
+  struct expr_func_registry r = {user_funcs, NULL, 0};
+  struct expr_program *p = expr_program_create(rules, n, &vars, &r);
+  struct expr *refs[8];
+  expr_num_t out[8];
+  assert(p != NULL && p->shared > 0);
+  for (int i = 0; i < n; i++) {
+    refs[i] = expr_create(rules[i], strlen(rules[i]), &ref_vars, user_funcs);
+  }
+  for (int step = 0; step < 5; step++) {
+    const char *names[] = {"a", "b", "c"};
+    for (int k = 0; k < 3; k++) {
+      expr_var(&vars, names[k], 1)->value = (expr_num_t)(step * (k + 1) % 5);
+      expr_var(&ref_vars, names[k], 1)->value =
+          (expr_num_t)(step * (k + 1) % 5);
+    }
+    expr_program_eval(p, out);
+    for (int i = 0; i < n; i++) {
+      expr_num_t expected = expr_eval(refs[i]);
+      if (out[i] != expected) {
+        printf("FAIL: %s: program %f != %f\n", rules[i], (double)out[i],
+               (double)expected);
+        status = 1;
+      }
+    }
+  }
+  printf("OK: program of %d rules, %d shared\n", n, p->shared);
+  for (int i = 0; i < n; i++) {
+    expr_destroy(refs[i], NULL);
+  }
+  expr_program_destroy(p);
+  expr_destroy(NULL, &vars);
+  expr_destroy(NULL, &ref_vars);
+  p = expr_program_create(rules, 0, &vars, &r);
+  assert(p != NULL);
+  expr_program_eval(p, out);
+  expr_program_destroy(p);
+  rules[0] = "1+";
+  assert(expr_program_create(rules, n, &vars, &r) == NULL);
+  expr_destroy(NULL, &vars);
+}
+
+/* Writes the expression or program into a buffer, returns its size */
+static size_t save(struct expr *e, struct expr_program *p, char *buf,
+                   size_t size) {
+  FILE *f = tmpfile();
+  size_t n;
+  assert(f != NULL);
+  assert((p != NULL ? expr_program_write(p, f) : expr_write(e, f)) == 0);
+  rewind(f);
+  n = fread(buf, 1, size, f);
+  assert(n < size);
+  fclose(f);
+  return n;
+}
+
+static void test_save() {
+  const char *exprs[] = {
+      "a*b+c",
+      "x=a<<2, y=-x, (!y || ~a) + x%3",
+      "add(a, next(b))",
+      "$(sqr, $1*$1), $(f, sqr($1)+sqr($2)+c), f(a, b)*f(b, a)",
+      "(a+b)*(a+b)+(a+b)",
+      "",
+      "$(inc, c=c+1), $(twice, inc(), inc()), (a*b+c)*twice()*(a*b+c)",
+  };
+  static char buf[4096];
+  struct expr_func_registry r = {user_funcs, NULL, 0};
+  for (unsigned int i = 0; i < sizeof(exprs) / sizeof(exprs[0]); i++) {
+    struct expr_var_list vars = {0};
+    struct expr_var_list loaded_vars = {0};
+    struct expr_arena arena = {0};
+    struct expr *e = expr_create(exprs[i], strlen(exprs[i]), &vars, user_funcs);
+    struct expr *loaded[2];
+    size_t n;
+    assert(e != NULL);
+    if (i == 4) {
+      assert(expr_cse(e, &vars) == 1);
+    }
+    n = save(e, NULL, buf, sizeof(buf));
+    loaded[0] = expr_load(buf, n, &loaded_vars, &r, NULL);
+    loaded[1] = expr_load(buf, n, &loaded_vars, &r, &arena);
+    if (loaded[0] == NULL || loaded[1] == NULL) {
+      printf("FAIL: %s: can't load\n", exprs[i]);
+      status = 1;
+    } else {
+      if (i == 6) {
+        /* Assignments in the loaded macros are still seen */
+        assert(expr_cse(loaded[0], &loaded_vars) == 0);
+      }
+      for (int k = 0; k < 2; k++) {
+        expr_num_t expected, result;
+        expr_var(&vars, "a", 1)->value = 3;
+        expr_var(&vars, "b", 1)->value = 4;
+        expr_var(&vars, "c", 1)->value = 5;
+        expr_var(&loaded_vars, "a", 1)->value = 3;
+        expr_var(&loaded_vars, "b", 1)->value = 4;
+        expr_var(&loaded_vars, "c", 1)->value = 5;
+        expected = expr_eval(e);
+        result = expr_eval(loaded[k]);
+        if (result != expected) {
+          printf("FAIL: %s: loaded %f != %f\n", exprs[i], (double)result,
+                 (double)expected);
+          status = 1;
+        }
+      }
+    }
+    /* Truncated data, unknown functions and another version fail */
+    assert(expr_load(buf, n - 1, &loaded_vars, &r, NULL) == NULL);
+    if (strncmp(exprs[i], "add(", 4) == 0) {
+      assert(expr_load(buf, n, &loaded_vars, NULL, NULL) == NULL);
+    }
+    buf[4]++;
+    assert(expr_load(buf, n, &loaded_vars, &r, NULL) == NULL);
+    expr_destroy(loaded[0], NULL);
+    expr_arena_free(&arena);
+    expr_destroy(e, &vars);
+    expr_destroy(NULL, &loaded_vars);
+  }
+
+  const char *rules[] = {"a*b+c", "(a*b+c)*2", "$(sqr, $1*$1), sqr(a*b+c)",
+                         "x=a+1, x*x"};
+  struct expr_var_list vars = {0};
+  struct expr_var_list loaded_vars = {0};
+  struct expr_program *p = expr_program_create(rules, 4, &vars, &r);
+  struct expr_program *q;
+  expr_num_t out[4], loaded_out[4];
+  size_t n = save(NULL, p, buf, sizeof(buf));
+  q = expr_program_load(buf, n, &loaded_vars, &r);
+  assert(q != NULL && q->n == 4 && q->shared == p->shared);
+  expr_var(&vars, "a", 1)->value = 2;
+  expr_var(&vars, "b", 1)->value = 3;
+  expr_var(&vars, "c", 1)->value = 4;
+  expr_var(&loaded_vars, "a", 1)->value = 2;
+  expr_var(&loaded_vars, "b", 1)->value = 3;
+  expr_var(&loaded_vars, "c", 1)->value = 4;
+  expr_program_eval(p, out);
+  expr_program_eval(q, loaded_out);
+  for (int i = 0; i < 4; i++) {
+    if (out[i] != loaded_out[i]) {
+      printf("FAIL: %s: loaded program %f != %f\n", rules[i],
+             (double)loaded_out[i], (double)out[i]);
+      status = 1;
+    }
+  }
+  assert(expr_load(buf, n, &loaded_vars, &r, NULL) == NULL);
+  assert(expr_program_load(buf, n / 2, &loaded_vars, &r) == NULL);
+  printf("OK: saved and loaded %d bytes\n", (int)n);
+  expr_program_destroy(p);
+  expr_program_destroy(q);
+
+  /* Nesting deeper than EXPR_SAVE_DEPTH is rejected, not recursed into */
+  static char deep[EXPR_SAVE_DEPTH + 4096];
+  struct expr *e = expr_create("-a", 2, &vars, NULL);
+  size_t head = save(e, NULL, buf, sizeof(buf)) - 6;
+  for (int depth = 100; depth <= EXPR_SAVE_DEPTH + 1;
+       depth += EXPR_SAVE_DEPTH - 99) {
+    struct expr *loaded;
+    memcpy(deep, buf, head);
+    memset(deep + head, OP_UNARY_MINUS, depth);
+    memcpy(deep + head + depth, buf + head + 1, 5);
+    loaded = expr_load(deep, head + depth + 5, &loaded_vars, &r, NULL);
+    assert((loaded != NULL) == (depth < EXPR_SAVE_DEPTH));
+    expr_destroy(loaded, NULL);
+  }
+  expr_destroy(e, NULL);
+  expr_destroy(NULL, &vars);
+  expr_destroy(NULL, &loaded_vars);
+}
+
+static void test_batch(char *s) {
+  struct expr_var_list vars = {0};
+  struct expr_var_list ref_vars = {0};
+  struct expr *e = expr_create(s, strlen(s), &vars, user_funcs);
+  struct expr *ref = expr_create(s, strlen(s), &ref_vars, user_funcs);
+  struct expr_var *x = expr_var(&ref_vars, "x", 1);
+  struct expr_var *y = expr_var(&ref_vars, "y", 1);
+  struct expr_var *z = expr_var(&ref_vars, "z", 1);
+  expr_num_t xs[1000], ys[2000], out[1000];
+  for (int i = 0; i < 1000; i++) {
+    xs[i] = i * 0.5f;
+    ys[i * 2] = i % 7;
+  }
+  struct expr_column cols[] = {
+      {expr_var(&vars, "x", 1), xs, 1000, 1},
+      {expr_var(&vars, "y", 1), ys, 1000, 2},
+  };
+  expr_var(&vars, "z", 1)->value = 3;
+  if (expr_eval_batch(e, cols, 2, out, 1000) != 0) {
+    printf("FAIL: %s: batch evaluation failed\n", s);
+    status = 1;
+  } else {
+    int i;
+    for (i = 0; i < 1000; i++) {
+      for (struct expr_var *v = ref_vars.head; v; v = v->next) {
+        v->value = 0;
+      }
+      x->value = xs[i];
+      y->value = ys[i * 2];
+      z->value = 3;
+      expr_num_t expected = expr_eval(ref);
+      if (!(expr_isnan(expected) && expr_isnan(out[i])) && out[i] != expected) {
+        printf("FAIL: %s: row %d: %f != %f\n", s, i, (double)out[i],
+               (double)expected);
+        status = 1;
+        break;
+      }
+    }
+    if (expr_var(&vars, "x", 1)->value != xs[999]) {
+      printf("FAIL: %s: variables are not updated after batch\n", s);
+      status = 1;
+    } else if (i == 1000) {
+      printf("OK: %s batch\n", s);
+    }
+  }
+  expr_destroy(e, &vars);
+  expr_destroy(ref, &ref_vars);
+}
+
+static void test_batches() {
+  test_batch("x*2+y");
+  test_batch("x/y-z");
+  test_batch("(x>100)&&(y<3)||z");
+  test_batch("x&&(z=y)");
+  test_batch("(x|0)&5 ^ y<<2 | ^y");
+  test_batch("a=x+1, b=a*a, b%(y+1)");
+  test_batch("w=w+x, w");
+  test_batch("add(x, next(y)) + z");
+  test_batch("$(sqr, $1*$1), sqr(x) - sqr(y)");
+  test_batch("-x**(y/2)");
+  test_batch("x!=y, x==y, x<=y, x>=y, x>>y");
+  test_batch("((x<<20)|y)&(^(z<<2))^(x>y)");
+
+  /* Columns of many variables are bound through the slot index */
+  {
+    static char buf[1024];
+    struct expr_var_list vars = {0};
+    struct expr_column cols[50];
+    expr_num_t data[50][4], out[4];
+    struct expr *e;
+    int i, n = 0;
+    for (i = 0; i < 100; i++) {
+      n += sprintf(buf + n, "%sv%d", i > 0 ? "+" : "", i);
+    }
+    e = expr_create(buf, n, &vars, user_funcs);
+    for (i = 0; i < 100; i++) {
+      char name[8];
+      sprintf(name, "v%d", i);
+      expr_var(&vars, name, strlen(name))->value = 1;
+      if (i % 2 == 0) {
+        for (int row = 0; row < 4; row++) {
+          data[i / 2][row] = row;
+        }
+        cols[i / 2].var = expr_var(&vars, name, strlen(name));
+        cols[i / 2].data = data[i / 2];
+        cols[i / 2].len = 4;
+        cols[i / 2].stride = 1;
+      }
+    }
+    if (expr_eval_batch(e, cols, 50, out, 4) != 0 || out[0] != 50 ||
+        out[3] != 200) {
+      printf("FAIL: batch of 100 variables\n");
+      status = 1;
+    } else {
+      printf("OK: batch of 100 variables\n");
+    }
+    expr_destroy(e, &vars);
+  }
+}
+
+static void test_batch_mt(char *s, int nthreads) {
+  enum { N = 100000 };
+  struct expr_var_list vars = {0};
+  struct expr *e = expr_create(s, strlen(s), &vars, user_funcs);
+  expr_num_t *xs = (expr_num_t *)malloc(N * sizeof(expr_num_t));
+  expr_num_t *out = (expr_num_t *)malloc(N * sizeof(expr_num_t));
+  expr_num_t *ref = (expr_num_t *)malloc(N * sizeof(expr_num_t));
+  for (int i = 0; i < N; i++) {
+    xs[i] = (i * 7919) % 1000 * 0.25f;
+  }
+  struct expr_column cols[] = {{expr_var(&vars, "x", 1), xs, N, 1}};
+  expr_var(&vars, "z", 1)->value = 3;
+  long calls = user_count_calls;
+  int ok = (expr_eval_batch(e, cols, 1, ref, N) == 0);
+  long once = user_count_calls - calls;
+  for (struct expr_var *v = vars.head; v; v = v->next) {
+    v->value = (strcmp(v->name, "z") == 0 ? 3 : 0);
+  }
+  if (!ok || expr_eval_batch_mt(e, cols, 1, out, N, nthreads) != 0 ||
+      memcmp(out, ref, N * sizeof(expr_num_t)) != 0 ||
+      expr_var(&vars, "x", 1)->value != xs[N - 1] ||
+      user_count_calls - calls != once * 2) {
+    printf("FAIL: %s: %d threads\n", s, nthreads);
+    status = 1;
+  } else {
+    printf("OK: %s batch with %d threads\n", s, nthreads);
+  }
+  free(xs);
+  free(out);
+  free(ref);
+  expr_destroy(e, &vars);
+}
+
+static void test_batches_mt() {
+  test_batch_mt("x*2+z", 4);
+  test_batch_mt("(x>100)&&(x<150)||z", 0);
+  test_batch_mt("w=w+x, w", 3);
+  test_batch_mt("a=x+1, b=a*a, b%(z+1)", 1);
+  test_batch_mt("add(x, next(z))", 4);
+  test_batch_mt("((x<<20)|z)&^(x>>1)", 2);
+  test_batch_mt("$(sq, $1*$1), $(f, sq($1)+sq($2+z)), f(x, 1)-f(1, x)", 4);
+  /* Thread-safe calls run on all threads, other ones in the calling one */
+  test_batch_mt("count(x*2)+add(next(z), x)", 4);
+  test_batch_mt("x>500 && count(x)", 3);
+  test_batch_mt("$(f, count($1)*$1), f(x)+f(z)", 2);
+  test_batch_mt("nop(x)+x", 4);
+  test_batch_mt("add(x, z=x)", 4);
+  expr_thread_shutdown();
+  test_batch_mt("x*2+z", 2);
+  expr_thread_shutdown();
+}
+
+static int test_same(expr_num_t a, expr_num_t b) {
+  return (expr_isnan(a) && expr_isnan(b)) || memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+/*
+ * Compares native code and batch kernels with the interpreter for every pair
+ * of values of x and y, bit by bit except for NaN payloads.
+ */
+static void test_special(char *s, const expr_num_t *values, int n) {
+  enum { N = 32 };
+  struct expr_var_list vars = {0};
+  struct expr_var_list ref_vars = {0};
+  struct expr *e, *ref;
+  expr_num_t xs[N * N], ys[N * N], out[N * N], ref_out[N * N];
+  int i, rows = n * n, failed = 0;
+  assert(n <= N);
+#if JIT
+  expr_jit_enabled = 0;
+#endif
+  ref = expr_create(s, strlen(s), &ref_vars, user_funcs);
+#if JIT
+  expr_jit_enabled = 1;
+#endif
+  e = expr_create(s, strlen(s), &vars, user_funcs);
+  assert(e != NULL && ref != NULL);
+  struct expr_var *x = expr_var(&vars, "x", 1);
+  struct expr_var *y = expr_var(&vars, "y", 1);
+  struct expr_column cols[] = {{x, xs, N * N, 1}, {y, ys, N * N, 1}};
+  struct expr_column ref_cols[] = {{expr_var(&ref_vars, "x", 1), xs, N * N, 1},
+                                   {expr_var(&ref_vars, "y", 1), ys, N * N, 1}};
+  for (i = 0; i < rows; i++) {
+    xs[i] = values[i / n];
+    ys[i] = values[i % n];
+  }
+  if (expr_eval_batch(e, cols, 2, out, rows) != 0 ||
+      expr_eval_batch(ref, ref_cols, 2, ref_out, rows) != 0) {
+    printf("FAIL: %s: batch evaluation failed\n", s);
+    status = 1;
+    failed = 1;
+  }
+  for (i = 0; i < rows && !failed; i++) {
+    expr_num_t expected, native;
+    ref_cols[0].var->value = x->value = xs[i];
+    ref_cols[1].var->value = y->value = ys[i];
+    expected = expr_eval(ref);
+    native = expr_eval(e);
+    if (!test_same(native, expected) || !test_same(out[i], expected) ||
+        !test_same(ref_out[i], expected)) {
+      printf("FAIL: %s: x=%g y=%g: %g, batch %g, interpreted %g, batch %g\n",
+             s, (double)xs[i], (double)ys[i], (double)native, (double)out[i],
+             (double)expected, (double)ref_out[i]);
+      status = 1;
+      failed = 1;
+    }
+  }
+  if (!failed) {
+    printf("OK: %s special values\n", s);
+  }
+  expr_destroy(e, &vars);
+  expr_destroy(ref, &ref_vars);
+}
+
+static void test_specials() {
+  static char *binary[] = {"**", "/", "*", "%", "+", "-", "<<", ">>", "<",
+                           "<=", ">", ">=", "==", "!=", "&", "|", "^", "&&",
+                           "||", ",", "="};
+  static char *unary[] = {"-x", "!x", "^x", "-(x+y)", "!(x-y)", "^(x|y)"};
+  static const expr_num_t values[] = {
+#if EXPR_INT64
+      0, 1, -1, 2, 3, 31, 32, 33, -33, 63, 64, 65, -64, 1LL << 40,
+      9223372036854775807LL, -9223372036854775807LL - 1,
+#else
+      NAN, INFINITY, -INFINITY, 0, -0.0, 1, -1, 0.5, -2.5, 3, 31, 32, 33,
+      -33, 64, 1e10, -1e10, 2147483648.0, -2147483648.0, 16777217,
+#endif
+  };
+  int n = sizeof(values) / sizeof(values[0]);
+  char s[32];
+  for (unsigned int i = 0; i < sizeof(binary) / sizeof(binary[0]); i++) {
+    sprintf(s, "x%sy", binary[i]);
+    test_special(s, values, n);
+    sprintf(s, "x%s3", binary[i]);
+    test_special(s, values, n);
+    if (*binary[i] != '=') {
+      sprintf(s, "3%sy", binary[i]);
+      test_special(s, values, n);
+    }
+  }
+  for (unsigned int i = 0; i < sizeof(unary) / sizeof(unary[0]); i++) {
+    test_special(unary[i], values, n);
+  }
 }
 
 static void test_name_collision() {
@@ -325,8 +1272,10 @@ static void test_fancy_variable_names() {
   test_expr("six=6, seven=7, six*seven", 42);
   test_expr("шість=6, сім=7, шість*сім", 42);
   test_expr("六=6, 七=7, 六*七", 42);
+#if !EXPR_INT64
   test_expr("ταῦ=1.618, 3*ταῦ", 3 * 1.618);
   test_expr("$(ταῦ, 1.618), 3*ταῦ()", 3 * 1.618);
+#endif
   test_expr("x#4=12, x#3=3, x#4+x#3", 15);
 }
 
@@ -342,26 +1291,99 @@ static void test_auto_comma() {
   test_expr("a=\n3*\n(4+\n3)\na+\na\n", 42);
 }
 
-static void test_benchmark(const char *s) {
-  struct timeval t;
-  gettimeofday(&t, NULL);
-  double start = t.tv_sec + t.tv_usec * 1e-6;
+static void test_long_script() {
+  int n = 100000;
+  size_t len = 0;
+  char *s = (char *)malloc(n * 16 + 16);
   struct expr_var_list vars = {0};
-  struct expr *e = expr_create(s, strlen(s), &vars, user_funcs);
-  if (e == NULL) {
-    printf("FAIL: %s can't be compiled\n", s);
-    status = 1;
-    return;
+  struct expr *e;
+  assert(s != NULL);
+  /* Statements are kept in order in a balanced tree, which is evaluated and
+     released without deep recursion */
+  for (int i = 0; i < n; i++) {
+    len += sprintf(s + len, "%s\n", (i % 2 ? "x=x+1" : "y=x"));
   }
-  long N = 1000000L;
-  for (long i = 0; i < N; i++) {
-    expr_eval(e);
+  len += sprintf(s + len, "x*2+y");
+  e = expr_create(s, len, &vars, user_funcs);
+  if (e == NULL || expr_eval(e) != n / 2 * 2 + (n / 2 - 1)) {
+    printf("FAIL: script of %d statements\n", n);
+    status = 1;
   }
-  gettimeofday(&t, NULL);
-  double end = t.tv_sec + t.tv_usec * 1e-6;
   expr_destroy(e, &vars);
-  double ns = 1000000000 * (end - start) / N;
-  printf("BENCH %40s:\t%f ns/op (%dM op/sec)\n", s, ns, (int)(1000 / ns));
+  printf("OK: script of %d statements\n", n);
+  /* Long chains of operators are evaluated in every form and released without
+     deep recursion too, in macro bodies as well */
+  for (int k = 0; k < 2; k++) {
+    struct expr_code *c;
+    struct expr_flat *f;
+    len = sprintf(s, "%s", (k ? "$(sum, " : "x=3, "));
+    for (int i = 0; i < 3 * n; i++) {
+      len += sprintf(s + len, "%s%s", (i > 0 ? "+" : ""), (k ? "$1" : "x"));
+    }
+    len += sprintf(s + len, "%s", (k ? "), sum(3)" : ""));
+    e = expr_create(s, len, &vars, user_funcs);
+    assert(e != NULL);
+    c = expr_code_create(e);
+    f = expr_flat_create(e);
+    if (expr_eval(e) != 9 * n || c == NULL || expr_code_eval(c) != 9 * n ||
+        f == NULL || expr_flat_eval(f) != 9 * n || expr_cse(e, &vars) == -1 ||
+        expr_eval(e) != 9 * n) {
+      printf("FAIL: chain of %d operators%s\n", 3 * n, (k ? " in a macro" : ""));
+      status = 1;
+    }
+    expr_code_destroy(c);
+    expr_flat_destroy(f);
+    expr_destroy(e, &vars);
+  }
+  printf("OK: chain of %d operators\n", 3 * n);
+  /* Operands of a rewritten chain are evaluated in the same order */
+  {
+    expr_num_t x = 1, expected = 1;
+    len = sprintf(s, "x=0, (x=x+1)");
+    for (int i = 0; i < 300; i++) {
+      len += sprintf(s + len, "%s(x=x+1)", (i % 2 ? "+" : "-"));
+      x = x + 1;
+      expected = (i % 2 ? expected + x : expected - x);
+    }
+    test_expr(s, expected);
+  }
+  /* Long bitwise chains keep their integer operands exact */
+  len = sprintf(s, "((1<<24)|1");
+  for (int i = 0; i < 300; i++) {
+    len += sprintf(s + len, "|0");
+  }
+  sprintf(s + len, ")&1");
+  test_expr(s, 1);
+  /* Every chain has its own temporary, which is not on the variable list,
+     loaded expressions too */
+  {
+    static char buf[65536];
+    struct expr_func_registry r = {user_funcs, NULL, 0};
+    struct expr *chains[3];
+    int nvars = 0;
+    len = sprintf(s, "x");
+    for (int i = 0; i < 300; i++) {
+      len += sprintf(s + len, "+x");
+    }
+    chains[0] = expr_create(s, len, &vars, user_funcs);
+    chains[1] = expr_create(s, len, &vars, user_funcs);
+    assert(chains[0] != NULL && chains[1] != NULL);
+    chains[2] = expr_load(buf, save(chains[0], NULL, buf, sizeof(buf)), &vars,
+                          &r, NULL);
+    expr_var(&vars, "x", 1)->value = 2;
+    for (struct expr_var *v = vars.head; v; v = v->next) {
+      nvars++;
+    }
+    if (nvars != 1 || vars.ntemps != 3 || chains[2] == NULL ||
+        expr_eval(chains[0]) != 602 || expr_eval(chains[2]) != 602) {
+      printf("FAIL: temporaries of chains\n");
+      status = 1;
+    }
+    expr_destroy(chains[0], NULL);
+    expr_destroy(chains[1], NULL);
+    expr_destroy(chains[2], &vars);
+  }
+  free(s);
 }
 
 static void test_bad_syntax() {
@@ -410,35 +1432,32 @@ int main() {
   test_const();
   test_unary();
   test_binary();
+  test_int64();
   test_logical();
   test_parens();
   test_assign();
   test_comma();
   test_funcs();
+  test_registry();
+  test_cache();
+  test_frames();
+  test_optimizations();
+  test_cses();
+  test_incrementals();
+  test_incremental_uses();
+  test_program();
+  test_save();
+  test_batches();
+  test_batches_mt();
+  test_specials();
 
   test_name_collision();
   test_fancy_variable_names();
 
   test_auto_comma();
+  test_long_script();
 
   test_bad_syntax();
 
-  test_benchmark("5");
-  test_benchmark("5+5+5+5+5+5+5+5+5+5");
-  test_benchmark("5*5*5*5*5*5*5*5*5*5");
-  test_benchmark("5,5,5,5,5,5,5,5,5,5");
-  test_benchmark("((5+5)+(5+5))+((5+5)+(5+5))+(5+5)");
-  test_benchmark("x=5");
-  test_benchmark("x=5,x+x+x+x+x+x+x+x+x+x");
-  test_benchmark("x=5,((x+x)+(x+x))+((x+x)+(x+x))+(x+x)");
-  test_benchmark("a=1,b=2,c=3,d=4,e=5,f=6,g=7,h=8,i=9,j=10");
-  test_benchmark("a=1,a=2,a=3,a=4,a=5,a=6,a=7,a=8,a=9,a=10");
-  test_benchmark("$(sqr,$1*$1),5*5");
-  test_benchmark("$(sqr,$1*$1),sqr(5)");
-  test_benchmark("x=2+3*(x/(42+next(x))),x");
-  test_benchmark("add(next(x), next(next(x)))");
-  test_benchmark("a,b,c,d,e,d,e,f,g,h,i,j,k");
-  test_benchmark("$(a,1),$(b,2),$(c,3),$(d,4),5");
-
   return status;
 }
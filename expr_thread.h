@@ -0,0 +1,361 @@
+#ifndef EXPR_THREAD_H
+#define EXPR_THREAD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <stdint.h> /* for intptr_t */
+#include <unistd.h> /* for sysconf */
+
+#include "expr.h"
+
+/*
+ * Multithreaded batch evaluation. Rows are split into chunks of
+ * EXPR_THREAD_CHUNK rows, every thread gets an equal range of chunks and takes
+ * them from the front. A thread that runs out of chunks steals from the back
+ * of other ranges, so slow rows don't leave other threads idle. Chunks are
+ * evaluated in blocks of EXPR_BATCH_SIZE rows by the batch kernels if the
+ * expression keeps to its block, otherwise row by row in private frames of
+ * the flat form. Every row is written to its own place in the output, so the
+ * result doesn't depend on scheduling. Worker threads are started on first use
+ * and wait in a pool for the next call.
+ */
+#ifndef EXPR_THREAD_CHUNK
+#define EXPR_THREAD_CHUNK 4096 /* multiple of EXPR_BATCH_SIZE */
+#endif
+
+#ifndef EXPR_THREAD_MAX
+#define EXPR_THREAD_MAX 64 /* workers in the pool, besides the calling thread */
+#endif
+
+struct expr_thread_queue {
+  pthread_mutex_t lock;
+  size_t lo; /* next chunk to take */
+  size_t hi; /* end of the range, thieves take from here */
+};
+
+struct expr_thread_job {
+  struct expr *e;
+  struct expr_batch *b; /* variables of the blocks, or NULL */
+  int depth;            /* scratch levels of the blocks */
+  struct expr_flat *f;  /* flat form evaluated row by row, or NULL */
+  struct expr_column *cols;
+  int *bound; /* column of each variable or -1 */
+  expr_num_t *init;
+  expr_num_t *last; /* variables after the last row */
+  expr_num_t *out;
+  size_t n;
+  struct expr_thread_queue *queues;
+  int nqueues;
+};
+
+struct expr_thread_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t wake; /* workers wait here for a job */
+  pthread_cond_t idle; /* the caller waits here for the workers */
+  pthread_t threads[EXPR_THREAD_MAX];
+  int nthreads;       /* workers started */
+  int busy;           /* a job is running */
+  int quit;           /* workers must exit */
+  unsigned long jobs; /* number of the current job */
+  int want;           /* workers that take part in it */
+  int active;         /* of them, still running it */
+  struct expr_thread_job *job;
+};
+
+static struct expr_thread_pool expr_thread_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .idle = PTHREAD_COND_INITIALIZER,
+};
+
+/* Returns index of the next chunk for the thread or -1 if all are done */
+static long expr_thread_take(struct expr_thread_job *job, int id) {
+  long chunk = -1;
+  for (int i = 0; i < job->nqueues && chunk == -1; i++) {
+    struct expr_thread_queue *q = &job->queues[(id + i) % job->nqueues];
+    pthread_mutex_lock(&q->lock);
+    if (q->lo < q->hi) {
+      chunk = (long)(i == 0 ? q->lo++ : --q->hi);
+    }
+    pthread_mutex_unlock(&q->lock);
+  }
+  return chunk;
+}
+
+/* Evaluates chunks in blocks, with variables and scratch of the thread */
+static void expr_thread_blocks(struct expr_thread_job *job, int id) {
+  struct expr_batch b = *job->b; /* shares the variables and their index */
+  int k, nvars = vec_len(&b.vars);
+  size_t row, end;
+  long chunk;
+  b.values = (expr_num_t *)malloc((nvars + job->depth + 1) * EXPR_BATCH_SIZE *
+                                  sizeof(expr_num_t));
+  if (b.values == NULL) {
+    return; /* other threads will steal the chunks */
+  }
+  b.scratch = b.values + nvars * EXPR_BATCH_SIZE;
+  while ((chunk = expr_thread_take(job, id)) != -1) {
+    row = (size_t)chunk * EXPR_THREAD_CHUNK;
+    end = row + EXPR_THREAD_CHUNK;
+    for (end = (end > job->n ? job->n : end); row < end; row += b.n) {
+      b.n = (end - row < EXPR_BATCH_SIZE ? (int)(end - row) : EXPR_BATCH_SIZE);
+      expr_batch_load(&b, job->cols, job->bound, row);
+      expr_batch_run(&b, job->e, job->out + row);
+      if (row + b.n == job->n) {
+        for (k = 0; k < nvars; k++) {
+          job->last[k] = b.values[k * EXPR_BATCH_SIZE + b.n - 1];
+        }
+      }
+    }
+  }
+  free(b.values);
+}
+
+/* Evaluates chunks row by row, in a frame of the thread */
+static void expr_thread_rows(struct expr_thread_job *job, int id) {
+  int nslots = vec_len(&job->f->vars);
+  expr_num_t *slots =
+      (expr_num_t *)malloc((nslots + 1) * sizeof(expr_num_t));
+  long chunk;
+  if (slots == NULL) {
+    return; /* other threads will steal the chunks */
+  }
+  while ((chunk = expr_thread_take(job, id)) != -1) {
+    size_t row = (size_t)chunk * EXPR_THREAD_CHUNK;
+    size_t end = row + EXPR_THREAD_CHUNK;
+    for (end = (end > job->n ? job->n : end); row < end; row++) {
+      for (int k = 0; k < nslots; k++) {
+        struct expr_column *col =
+            (job->bound[k] == -1 ? NULL : &job->cols[job->bound[k]]);
+        slots[k] = (col == NULL ? job->init[k] : col->data[row * col->stride]);
+      }
+      job->out[row] = expr_flat_eval_frame(job->f, slots);
+      if (row == job->n - 1) {
+        memcpy(job->last, slots, nslots * sizeof(expr_num_t));
+      }
+    }
+  }
+  free(slots);
+}
+
+static void expr_thread_run(struct expr_thread_job *job, int id) {
+  if (job->f != NULL) {
+    expr_thread_rows(job, id);
+  } else {
+    expr_thread_blocks(job, id);
+  }
+}
+
+static void *expr_thread_main(void *arg) {
+  struct expr_thread_pool *p = &expr_thread_pool;
+  int id = (int)(intptr_t)arg;
+  unsigned long seen = 0;
+  struct expr_thread_job *job;
+  pthread_mutex_lock(&p->lock);
+  for (;;) {
+    while (!p->quit && (p->jobs == seen || id > p->want)) {
+      pthread_cond_wait(&p->wake, &p->lock);
+    }
+    if (p->quit) {
+      break;
+    }
+    seen = p->jobs;
+    job = p->job;
+    pthread_mutex_unlock(&p->lock);
+    expr_thread_run(job, id);
+    pthread_mutex_lock(&p->lock);
+    if (--p->active == 0) {
+      pthread_cond_signal(&p->idle);
+    }
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+/*
+ * Hands the job to up to nworkers workers, starting more if needed. Returns
+ * the number of workers that took it, or -1 if the pool is running another
+ * job, e.g. for a function called by one of its workers.
+ */
+static int expr_thread_start(struct expr_thread_job *job, int nworkers) {
+  struct expr_thread_pool *p = &expr_thread_pool;
+  int n;
+  pthread_mutex_lock(&p->lock);
+  if (p->busy) {
+    pthread_mutex_unlock(&p->lock);
+    return -1;
+  }
+  nworkers = (nworkers > EXPR_THREAD_MAX ? EXPR_THREAD_MAX : nworkers);
+  while (p->nthreads < nworkers &&
+         pthread_create(&p->threads[p->nthreads], NULL, expr_thread_main,
+                        (void *)(intptr_t)(p->nthreads + 1)) == 0) {
+    p->nthreads++;
+  }
+  n = (p->nthreads < nworkers ? p->nthreads : nworkers);
+  p->busy = 1;
+  p->job = job;
+  p->want = p->active = n;
+  p->jobs++;
+  pthread_cond_broadcast(&p->wake);
+  pthread_mutex_unlock(&p->lock);
+  return n;
+}
+
+/* Waits until the workers are done with the job */
+static void expr_thread_wait(void) {
+  struct expr_thread_pool *p = &expr_thread_pool;
+  pthread_mutex_lock(&p->lock);
+  while (p->active > 0) {
+    pthread_cond_wait(&p->idle, &p->lock);
+  }
+  p->busy = 0;
+  p->job = NULL;
+  pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * Stops the pool workers, e.g. before unloading the code. The next call of
+ * expr_eval_batch_mt() starts them again. Must not be called while a batch
+ * is evaluated.
+ */
+EXPR_UNUSED
+static void expr_thread_shutdown(void) {
+  struct expr_thread_pool *p = &expr_thread_pool;
+  int i, n;
+  pthread_mutex_lock(&p->lock);
+  p->quit = 1;
+  n = p->nthreads;
+  pthread_cond_broadcast(&p->wake);
+  pthread_mutex_unlock(&p->lock);
+  for (i = 0; i < n; i++) {
+    pthread_join(p->threads[i], NULL);
+  }
+  pthread_mutex_lock(&p->lock);
+  p->quit = 0;
+  p->nthreads = 0;
+  pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * Same as expr_eval_batch(), but rows are evaluated by nthreads threads
+ * including the calling one, or one per CPU if nthreads is 0. Expressions
+ * that read or write the variables themselves, e.g. calls of functions that
+ * are neither pure nor thread-safe, are evaluated by expr_eval_batch() in the
+ * calling thread.
+ */
+EXPR_UNUSED
+static int expr_eval_batch_mt(struct expr *e, struct expr_column *cols,
+                              int ncols, expr_num_t *out, size_t n,
+                              int nthreads) {
+  struct expr_thread_job job;
+  struct expr_batch b = {vec_init(), vec_init(), NULL, NULL, 0, {NULL, 0}};
+  size_t nchunks = (n + EXPR_THREAD_CHUNK - 1) / EXPR_THREAD_CHUNK;
+  struct expr_slot_index *slots;
+  expr_num_t **vars;
+  int i, k, nvars, workers, status = -1;
+
+  if (nthreads <= 0) {
+    nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (nthreads > EXPR_THREAD_MAX + 1) {
+    nthreads = EXPR_THREAD_MAX + 1;
+  }
+  if ((size_t)nthreads > nchunks) {
+    nthreads = (int)nchunks;
+  }
+  for (i = 0; i < ncols; i++) {
+    if (cols[i].len < n) {
+      return -1; /* column is too short */
+    }
+  }
+  if (nthreads <= 1) {
+    return expr_eval_batch(e, cols, ncols, out, n);
+  }
+  memset(&job, 0, sizeof(job));
+  job.e = e;
+#if JIT
+  if (e->batchfn != NULL || expr_batch_safe(e)) {
+#else
+  if (expr_batch_safe(e)) {
+#endif
+    if ((job.depth = expr_batch_collect(&b, e)) == -1) {
+      goto cleanup;
+    }
+    job.b = &b;
+    slots = &b.index;
+    vars = b.vars.buf;
+    nvars = vec_len(&b.vars);
+  } else {
+    job.f = expr_flat_create(e);
+    for (i = 0; job.f != NULL && i < vec_len(&job.f->funcs); i++) {
+      if (vec_nth(&job.f->funcs, i).args == -1) {
+        break; /* the call reads variables from the tree */
+      }
+    }
+    if (job.f == NULL || i < vec_len(&job.f->funcs)) {
+      expr_flat_destroy(job.f);
+      return expr_eval_batch(e, cols, ncols, out, n);
+    }
+    slots = &job.f->index;
+    vars = job.f->vars.buf;
+    nvars = vec_len(&job.f->vars);
+  }
+  job.cols = cols;
+  job.out = out;
+  job.n = n;
+  job.bound = (int *)malloc((nvars + 1) * sizeof(int));
+  job.init = (expr_num_t *)malloc((nvars + 1) * sizeof(expr_num_t));
+  job.last = (expr_num_t *)malloc((nvars + 1) * sizeof(expr_num_t));
+  job.queues =
+      (struct expr_thread_queue *)calloc(nthreads, sizeof(*job.queues));
+  if (job.bound == NULL || job.init == NULL || job.last == NULL ||
+      job.queues == NULL) {
+    goto cleanup; /* allocation failed */
+  }
+  expr_batch_bind(slots, vars, nvars, cols, ncols, job.bound);
+  for (k = 0; k < nvars; k++) {
+    job.init[k] = *vars[k];
+  }
+  for (i = 0; i < nthreads; i++) {
+    pthread_mutex_init(&job.queues[i].lock, NULL);
+    job.queues[i].lo = nchunks * i / nthreads;
+    job.queues[i].hi = nchunks * (i + 1) / nthreads;
+  }
+  job.nqueues = nthreads;
+  /* Ranges of the workers that didn't take the job are stolen by the others */
+  workers = expr_thread_start(&job, nthreads - 1);
+  expr_thread_run(&job, 0);
+  if (workers != -1) {
+    expr_thread_wait();
+  }
+  /* Chunks are left only if no thread could allocate its buffers */
+  status = 0;
+  for (i = 0; i < nthreads; i++) {
+    if (job.queues[i].lo < job.queues[i].hi) {
+      status = -1;
+    }
+    pthread_mutex_destroy(&job.queues[i].lock);
+  }
+  if (status == 0) {
+    for (k = 0; k < nvars; k++) {
+      *vars[k] = job.last[k];
+    }
+  }
+cleanup:
+  free(job.queues);
+  free(job.last);
+  free(job.init);
+  free(job.bound);
+  expr_flat_destroy(job.f);
+  expr_batch_free(&b);
+  return status;
+}
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* EXPR_THREAD_H */